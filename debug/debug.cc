@@ -49,13 +49,13 @@ void disassembleInstruction(chunk_iter* iter, Chunk* chunk){
             byteInstruction("OP_SET_LOCAL", iter, chunk);
             break;
         case OP_GET_GLOBAL:
-            constantInstruction("OP_GET_GLOBAL", iter, chunk);
+            byteInstruction("OP_GET_GLOBAL", iter, chunk);
             break;
         case OP_DEFINE_GLOBAL:
-            constantInstruction("OP_DEFINE_GLOBAL", iter, chunk);
+            byteInstruction("OP_DEFINE_GLOBAL", iter, chunk);
             break;
         case OP_SET_GLOBAL:
-            constantInstruction("OP_SET_GLOBAL", iter, chunk);
+            byteInstruction("OP_SET_GLOBAL", iter, chunk);
             break;
         case OP_GET_UPVALUE:
             byteInstruction("OP_GET_UPVALUE", iter, chunk);
@@ -64,10 +64,10 @@ void disassembleInstruction(chunk_iter* iter, Chunk* chunk){
             byteInstruction("OP_SET_UPVALUE", iter, chunk);
             break;
         case OP_GET_PROPERTY:
-            constantInstruction("OP_GET_PROPERTY", iter, chunk);
+            propertyInstruction("OP_GET_PROPERTY", iter, chunk);
             break;
         case OP_SET_PROPERTY:
-            constantInstruction("OP_SET_PROPERTY", iter, chunk);
+            propertyInstruction("OP_SET_PROPERTY", iter, chunk);
             break;
         case OP_EQUAL:
             simpleInstruction("OP_EQUAL", iter);
@@ -117,26 +117,9 @@ void disassembleInstruction(chunk_iter* iter, Chunk* chunk){
         case OP_CLASS:
             constantInstruction("OP_CLASS", iter, chunk);
             break;
-        case OP_CLOSURE: {
-            ++(*iter);
-            std::cout << " OP_CLOSURE" << " " << (int8_t)**iter << " ";
-            value_t constant = chunk->getValue(**iter);
-            Value::printValue(constant);
-            ObjFunction* function = AS_FUNCTION(constant);
-            for (int j = 0; j < function->upvalueCount; j++) {
-                ++(*iter);
-                int isLocal = **iter;
-                ++(*iter);
-                int index = **iter;
-                // print if it's local.
-                std::cout << " |  " << isLocal ? "local" : "upvalue";
-                // print index of upvalue
-                std::cout << " " << index;
-            } 
-            std::cout << std::endl;
-            ++(*iter);
+        case OP_CLOSURE:
+            closureInstruction("OP_CLOSURE", iter, chunk);
             break;
-        }
         case OP_METHOD:
             constantInstruction("OP_METHOD", iter, chunk);
             break;
@@ -149,6 +132,99 @@ void disassembleInstruction(chunk_iter* iter, Chunk* chunk){
         case OP_SUPER_INVOKE:
             invokeInstruction("OP_SUPER_INVOKE", iter, chunk);
             break;
+        case OP_CONSTANT_LONG:
+            constantInstruction("OP_CONSTANT_LONG", iter, chunk, 3);
+            break;
+        case OP_GET_GLOBAL_LONG:
+            longInstruction("OP_GET_GLOBAL_LONG", iter, chunk);
+            break;
+        case OP_DEFINE_GLOBAL_LONG:
+            longInstruction("OP_DEFINE_GLOBAL_LONG", iter, chunk);
+            break;
+        case OP_SET_GLOBAL_LONG:
+            longInstruction("OP_SET_GLOBAL_LONG", iter, chunk);
+            break;
+        case OP_GET_PROPERTY_LONG:
+            propertyInstruction("OP_GET_PROPERTY_LONG", iter, chunk, 3);
+            break;
+        case OP_SET_PROPERTY_LONG:
+            propertyInstruction("OP_SET_PROPERTY_LONG", iter, chunk, 3);
+            break;
+        case OP_INVOKE_LONG:
+            invokeInstruction("OP_INVOKE_LONG", iter, chunk, 3);
+            break;
+        case OP_SUPER_INVOKE_LONG:
+            invokeInstruction("OP_SUPER_INVOKE_LONG", iter, chunk, 3);
+            break;
+        case OP_CLOSURE_LONG:
+            closureInstruction("OP_CLOSURE_LONG", iter, chunk, 3);
+            break;
+        case OP_CLASS_LONG:
+            constantInstruction("OP_CLASS_LONG", iter, chunk, 3);
+            break;
+        case OP_METHOD_LONG:
+            constantInstruction("OP_METHOD_LONG", iter, chunk, 3);
+            break;
+        case OP_GET_SUPER_LONG:
+            constantInstruction("OP_GET_SUPER_LONG", iter, chunk, 3);
+            break;
+        case OP_NOT_EQUAL:
+            simpleInstruction("OP_NOT_EQUAL", iter);
+            break;
+        case OP_GREATER_EQUAL:
+            simpleInstruction("OP_GREATER_EQUAL", iter);
+            break;
+        case OP_LESS_EQUAL:
+            simpleInstruction("OP_LESS_EQUAL", iter);
+            break;
+        case OP_SET_LOCAL_POP:
+            byteInstruction("OP_SET_LOCAL_POP", iter, chunk);
+            break;
+        case OP_GET_LOCAL_LOCAL:
+            localPairInstruction("OP_GET_LOCAL_LOCAL", iter);
+            break;
+        case OP_ADD_LOCAL_CONSTANT:
+            localConstantInstruction("OP_ADD_LOCAL_CONSTANT", iter, chunk);
+            break;
+        case OP_LESS_JUMP_IF_FALSE:
+            jumpInstruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, iter);
+            break;
+        case OP_GET_THIS_PROPERTY:
+            propertyInstruction("OP_GET_THIS_PROPERTY", iter, chunk);
+            break;
+        case OP_ADD_NUM:
+            simpleInstruction("OP_ADD_NUM", iter);
+            break;
+        case OP_ADD_STR:
+            simpleInstruction("OP_ADD_STR", iter);
+            break;
+        case OP_LESS_NUM:
+            simpleInstruction("OP_LESS_NUM", iter);
+            break;
+        case OP_R_ADD:
+            registerInstruction("OP_R_ADD", iter, chunk, 2);
+            break;
+        case OP_R_SUBTRACT:
+            registerInstruction("OP_R_SUBTRACT", iter, chunk, 2);
+            break;
+        case OP_R_MULTIPLY:
+            registerInstruction("OP_R_MULTIPLY", iter, chunk, 2);
+            break;
+        case OP_R_DIVIDE:
+            registerInstruction("OP_R_DIVIDE", iter, chunk, 2);
+            break;
+        case OP_R_LESS:
+            registerInstruction("OP_R_LESS", iter, chunk, 2);
+            break;
+        case OP_R_GREATER:
+            registerInstruction("OP_R_GREATER", iter, chunk, 2);
+            break;
+        case OP_R_MOVE:
+            registerInstruction("OP_R_MOVE", iter, chunk, 1);
+            break;
+        case OP_R_LESS_JUMP:
+            registerJumpInstruction("OP_R_LESS_JUMP", iter, chunk);
+            break;
         default:
             std::cout << "unknown operation code " << instruction << std::endl;
             ++(*iter);
@@ -167,10 +243,73 @@ void byteInstruction(std::string op_name, chunk_iter* iter, Chunk* chunk){
     ++(*iter);
 }
 
-void constantInstruction(std::string op_name, chunk_iter* iter, Chunk* chunk){
+void localPairInstruction(std::string op_name, chunk_iter* iter){
+    int first = (*iter)[1];
+    int second = (*iter)[2];
+    std::cout << " " << op_name << " " << first << " " << second << std::endl;
+    *iter += 3;
+}
+
+void localConstantInstruction(std::string op_name, chunk_iter* iter, Chunk* chunk){
+    int slot = (*iter)[1];
+    int constant = (*iter)[2];
+    std::cout << " " << op_name << " " << slot << " " << constant << " ";
+    Value::printValue(chunk->getValue(constant));
+    std::cout << std::endl;
+    *iter += 3;
+}
+
+static void printRegister(uint8_t spec, Chunk* chunk){
+    if(spec & REGISTER_CONSTANT){
+        std::cout << " k" << (spec & ~REGISTER_CONSTANT) << "(";
+        Value::printValue(chunk->getValue(spec & ~REGISTER_CONSTANT));
+        std::cout << ")";
+    }else if(spec == REGISTER_STACK){
+        std::cout << " pop";
+    }else{
+        std::cout << " r" << (int)spec;
+    }
+}
+
+void registerInstruction(std::string op_name, chunk_iter* iter, Chunk* chunk, int sources){
+    int dst = (*iter)[1];
+    std::cout << " " << op_name << " ";
+    if(dst == 0) std::cout << "push";
+    else std::cout << "r" << dst;
+    for(int i = 0; i < sources; i++){
+        printRegister((*iter)[2 + i], chunk);
+    }
+    std::cout << std::endl;
+    *iter += 2 + sources;
+}
+
+void registerJumpInstruction(std::string op_name, chunk_iter* iter, Chunk* chunk){
     std::cout << " " << op_name;
-    uint8_t offset = *(++(*iter));
-    if (offset < chunk->getValueSize()){
+    printRegister((*iter)[1], chunk);
+    printRegister((*iter)[2], chunk);
+    uint16_t jump = (uint16_t)(((*iter)[3] << 8) | (*iter)[4]);
+    std::cout << " " << jump << std::endl;
+    *iter += 5;
+}
+
+// Reads the width byte operand that follows the opcode at iter.
+static uint32_t readOperand(chunk_iter iter, int width){
+    uint32_t operand = 0;
+    for(int i = 1; i <= width; i++){
+        operand = (operand << 8) | iter[i];
+    }
+    return operand;
+}
+
+void longInstruction(std::string op_name, chunk_iter* iter, Chunk* chunk){
+    std::cout << " " << op_name << " " << readOperand(*iter, 3) << std::endl;
+    *iter += 4;
+}
+
+void constantInstruction(std::string op_name, chunk_iter* iter, Chunk* chunk, int width){
+    std::cout << " " << op_name;
+    uint32_t offset = readOperand(*iter, width);
+    if (offset < (uint32_t)chunk->getValueSize()){
         value_t val = chunk->getValue(offset);
         std::cout << " " << (long)offset << " ";
         Value::printValue(val);
@@ -178,7 +317,32 @@ void constantInstruction(std::string op_name, chunk_iter* iter, Chunk* chunk){
     }else{
         std::cout << std::endl;
     }
-    ++(*iter);
+    *iter += 1 + width;
+}
+
+void closureInstruction(std::string op_name, chunk_iter* iter, Chunk* chunk, int width){
+    uint32_t constant = readOperand(*iter, width);
+    *iter += 1 + width;
+    std::cout << " " << op_name << " " << constant << " ";
+    value_t val = chunk->getValue(constant);
+    Value::printValue(val);
+    ObjFunction* function = AS_FUNCTION(val);
+    for (int j = 0; j < function->upvalueCount; j++) {
+        int isLocal = (*iter)[0];
+        int index = (*iter)[1];
+        *iter += 2;
+        std::cout << " |  " << (isLocal ? "local" : "upvalue") << " " << index;
+    }
+    std::cout << std::endl;
+}
+
+void propertyInstruction(std::string op_name, chunk_iter* iter, Chunk* chunk, int width){
+    uint32_t constant = readOperand(*iter, width);
+    uint16_t cache = (uint16_t)readOperand(*iter + width, 2);
+    std::cout << " " << op_name << " " << constant << " ";
+    Value::printValue(chunk->getValue(constant));
+    std::cout << " ic " << cache << std::endl;
+    *iter += 3 + width;
 }
 
 void jumpInstruction(std::string op_name, int sign,
@@ -190,14 +354,15 @@ void jumpInstruction(std::string op_name, int sign,
 }
 
 void invokeInstruction(std::string op_name, chunk_iter* iter,
-                                Chunk* chunk) {
-    uint8_t constant = (*iter)[1];
-    uint8_t argCount = (*iter)[2];
-    std::cout << " " << op_name << " " << (int)argCount;
+                                Chunk* chunk, int width) {
+    uint32_t constant = readOperand(*iter, width);
+    uint8_t argCount = (*iter)[1 + width];
+    std::cout << " " << op_name << " (" << (int)argCount << " args) ";
     std::cout << constant << " ";
     Value::printValue(chunk->getValue(constant));
-    std::cout << std::endl;
-    *iter += 3;
+    uint16_t cache = (uint16_t)readOperand(*iter + 1 + width, 2);
+    std::cout << " ic " << cache << std::endl;
+    *iter += 4 + width;
 }
 
 std::string get_op_code(uint8_t code){
@@ -238,6 +403,37 @@ std::string get_op_code(uint8_t code){
         case OP_SUPER_INVOKE: return "OP_SUPER_INVOKE";
         case OP_GET_UPVALUE: return "OP_GET_UPVALUE";
         case OP_SET_UPVALUE: return "OP_SET_UPVALUE";
+        case OP_CONSTANT_LONG: return "OP_CONSTANT_LONG";
+        case OP_GET_GLOBAL_LONG: return "OP_GET_GLOBAL_LONG";
+        case OP_DEFINE_GLOBAL_LONG: return "OP_DEFINE_GLOBAL_LONG";
+        case OP_SET_GLOBAL_LONG: return "OP_SET_GLOBAL_LONG";
+        case OP_GET_PROPERTY_LONG: return "OP_GET_PROPERTY_LONG";
+        case OP_SET_PROPERTY_LONG: return "OP_SET_PROPERTY_LONG";
+        case OP_INVOKE_LONG: return "OP_INVOKE_LONG";
+        case OP_SUPER_INVOKE_LONG: return "OP_SUPER_INVOKE_LONG";
+        case OP_CLOSURE_LONG: return "OP_CLOSURE_LONG";
+        case OP_CLASS_LONG: return "OP_CLASS_LONG";
+        case OP_METHOD_LONG: return "OP_METHOD_LONG";
+        case OP_GET_SUPER_LONG: return "OP_GET_SUPER_LONG";
+        case OP_NOT_EQUAL: return "OP_NOT_EQUAL";
+        case OP_GREATER_EQUAL: return "OP_GREATER_EQUAL";
+        case OP_LESS_EQUAL: return "OP_LESS_EQUAL";
+        case OP_SET_LOCAL_POP: return "OP_SET_LOCAL_POP";
+        case OP_GET_LOCAL_LOCAL: return "OP_GET_LOCAL_LOCAL";
+        case OP_ADD_LOCAL_CONSTANT: return "OP_ADD_LOCAL_CONSTANT";
+        case OP_LESS_JUMP_IF_FALSE: return "OP_LESS_JUMP_IF_FALSE";
+        case OP_GET_THIS_PROPERTY: return "OP_GET_THIS_PROPERTY";
+        case OP_ADD_NUM: return "OP_ADD_NUM";
+        case OP_ADD_STR: return "OP_ADD_STR";
+        case OP_LESS_NUM: return "OP_LESS_NUM";
+        case OP_R_ADD: return "OP_R_ADD";
+        case OP_R_SUBTRACT: return "OP_R_SUBTRACT";
+        case OP_R_MULTIPLY: return "OP_R_MULTIPLY";
+        case OP_R_DIVIDE: return "OP_R_DIVIDE";
+        case OP_R_LESS: return "OP_R_LESS";
+        case OP_R_GREATER: return "OP_R_GREATER";
+        case OP_R_MOVE: return "OP_R_MOVE";
+        case OP_R_LESS_JUMP: return "OP_R_LESS_JUMP";
         default: return "unknown operation code";
     }
 }
\ No newline at end of file
@@ -6,10 +6,17 @@
 void disassembleChunk(std::string, Chunk*);
 void disassembleInstruction(chunk_iter*, Chunk*);
 void simpleInstruction(std::string, chunk_iter*);
-void constantInstruction(std::string, chunk_iter*, Chunk*);
+void constantInstruction(std::string, chunk_iter*, Chunk*, int width = 1);
+void longInstruction(std::string, chunk_iter*, Chunk*);
+void closureInstruction(std::string, chunk_iter*, Chunk*, int width = 1);
 void byteInstruction(std::string name, chunk_iter* iter, Chunk* chunk);
+void localPairInstruction(std::string op_name, chunk_iter* iter);
+void localConstantInstruction(std::string op_name, chunk_iter* iter, Chunk* chunk);
+void registerInstruction(std::string op_name, chunk_iter* iter, Chunk* chunk, int sources);
+void registerJumpInstruction(std::string op_name, chunk_iter* iter, Chunk* chunk);
+void propertyInstruction(std::string op_name, chunk_iter* iter, Chunk* chunk, int width = 1);
 void jumpInstruction(std::string name, int sign, Chunk* chunk,  chunk_iter* iter);
-void invokeInstruction(std::string op_name, chunk_iter *iter, Chunk *chunk);
+void invokeInstruction(std::string op_name, chunk_iter *iter, Chunk *chunk, int width = 1);
 std::string get_op_code(uint8_t code);
 
 
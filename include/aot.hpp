@@ -0,0 +1,79 @@
+#ifndef LEVI_AOT_H
+#define LEVI_AOT_H
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include "vm.hpp"
+#include "runtime.hpp"
+
+// Ahead of time translation of a script to C++.
+//
+// AotWriter writes one C++ function per function of the compiled script,
+// with straight-line code for each instruction in place of the
+// interpreter's dispatch. The file also holds the source and a main(), and
+// is compiled against the headers and the levi_runtime library into a
+// standalone program:
+//
+//   levi --aot=script.cc script.lev
+//   c++ -O2 -Iinclude -Idebug script.cc liblevi_runtime.a -o script
+//
+// The program compiles the embedded source to bytecode as usual and
+// attaches each translated function to the function it was written from.
+// Translated code plays the part of the JIT's machine code: it handles
+// the common case of each instruction and hands calls, returns, class
+// definitions and errors to the interpreter, which comes back to it at
+// the next call, return or backward jump.
+struct AotModule{
+    const char* source;
+    size_t sourceSize;
+    // LEVC_REGISTERS if the script was compiled for the register backend
+    uint32_t flags;
+    uint32_t functionCount;
+    const AotFunction* functions;
+    // hash of the bytecode each function was translated from
+    const uint64_t* codeHashes;
+};
+
+class Aot{
+    public:
+        // The script's functions in the order the translation numbers
+        // them, the script first and then each constant depth first.
+        static std::vector<ObjFunction*> functions(ObjFunction* script);
+        // Returns false, attaching nothing, if the module was translated
+        // from other bytecode than the script compiles to.
+        static bool attach(ObjFunction* script, const AotModule* module);
+        // Runs the module's script, the main() of a translated program.
+        static int main(const AotModule* module);
+};
+
+class AotWriter{
+    public:
+        // Returns false if the file could not be written.
+        bool write(std::string path, const std::string& source, uint32_t flags, ObjFunction* script);
+    private:
+        void writeFunction(size_t index, ObjFunction* function);
+        void instruction(Chunk* chunk, size_t offset);
+        void registerInstruction(Chunk* chunk, size_t offset);
+        std::string number(value_t val);
+        std::string registerOperand(Chunk* chunk, uint8_t spec);
+        std::ostringstream out;
+        // offsets of the current function that code jumps or returns to
+        std::vector<bool> labels;
+};
+
+// Used by the translated code, with code, sp and frame in scope.
+#define AOT_EXIT(offset) do{ frame->ip = code + (offset); return sp; }while(false)
+#define AOT_CALL(helper, offset) \
+    do{ \
+        value_t* top = Runtime::helper(vm, sp, code + (offset)); \
+        if(top == NULL) AOT_EXIT(offset); \
+        sp = top; \
+    }while(false)
+#define AOT_NUMBERS(offset) \
+    do{ \
+        if(!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2])) AOT_EXIT(offset); \
+    }while(false)
+#define AOT_FALSEY(val) (IS_NIL(val) || (IS_BOOL(val) && !AS_BOOL(val)))
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef LEVI_CACHE_H
+#define LEVI_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+
+#define IC_ENTRIES 4
+
+struct Shape;
+struct ObjClass;
+struct ObjClosure;
+
+// One remembered outcome of a property access or invoke site.
+// Field entries only depend on the receiver's shape, method entries also
+// on its class because unrelated classes can share a shape.
+struct CacheEntry{
+    Shape* shape{NULL};
+    ObjClass* klass{NULL};    // set for method entries
+    ObjClosure* method{NULL}; // set for method entries
+    Shape* next{NULL};        // set by OP_SET_PROPERTY when it adds the field
+    int slot{-1};
+};
+
+// Per-instruction cache. It starts empty, holds up to IC_ENTRIES shapes
+// (monomorphic, then polymorphic) and gives up once a site has seen more,
+// after which the site always takes the generic lookup.
+struct InlineCache{
+    int count{0};
+    bool megamorphic{false};
+    CacheEntry entries[IC_ENTRIES];
+
+    CacheEntry* find(Shape* shape, ObjClass* klass){
+        for(int i = 0; i < count; i++){
+            CacheEntry* entry = &entries[i];
+            if(entry->shape == shape && (entry->method == NULL || entry->klass == klass)){
+                return entry;
+            }
+        }
+        return NULL;
+    }
+    // Returns the entry to fill in, or NULL once the site is megamorphic.
+    CacheEntry* add(){
+        if(megamorphic) return NULL;
+        if(count == IC_ENTRIES){
+            megamorphic = true;
+            return NULL;
+        }
+        entries[count] = CacheEntry();
+        return &entries[count++];
+    }
+};
+
+struct CacheStats{
+    size_t hits{0};
+    size_t misses{0};
+    size_t megamorphic{0};  // lookups at sites that stopped caching
+};
+
+#endif
@@ -4,9 +4,17 @@
 #include <vector>
 #include <memory>
 #include "value.hpp"
+#include "cache.hpp"
 
 using chunk_array = std::vector<uint8_t>;
-using line_array = std::vector<int>;
+// Consecutive bytes compiled from the same source line share one run,
+// which starts at offset and lasts until the next run starts.
+struct LineRun{
+    int offset;
+    int line;
+};
+
+using line_array = std::vector<LineRun>;
 using chunk_iter = chunk_array::const_iterator;
 
 enum OpCode {
@@ -47,26 +55,109 @@ enum OpCode {
     OP_METHOD,
     OP_INHERIT,
     OP_GET_SUPER,
+    // same as the instructions above, with a 24-bit constant or global
+    // operand for chunks that outgrow one byte
+    OP_CONSTANT_LONG,
+    OP_GET_GLOBAL_LONG,
+    OP_DEFINE_GLOBAL_LONG,
+    OP_SET_GLOBAL_LONG,
+    OP_GET_PROPERTY_LONG,
+    OP_SET_PROPERTY_LONG,
+    OP_INVOKE_LONG,
+    OP_SUPER_INVOKE_LONG,
+    OP_CLOSURE_LONG,
+    OP_CLASS_LONG,
+    OP_METHOD_LONG,
+    OP_GET_SUPER_LONG,
+    // fused forms written by the peephole optimizer. OP_GREATER_EQUAL and
+    // OP_LESS_EQUAL compute !(a < b) and !(a > b), the same as the pairs
+    // they replace, NaN operands included
+    OP_NOT_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
+    OP_SET_LOCAL_POP,
+    // superinstructions for sequences that dominate loops and methods:
+    //   OP_GET_LOCAL_LOCAL a b        OP_GET_LOCAL a, OP_GET_LOCAL b
+    //   OP_ADD_LOCAL_CONSTANT a k     OP_GET_LOCAL a, OP_CONSTANT k, OP_ADD
+    //   OP_LESS_JUMP_IF_FALSE offset  OP_LESS, OP_JUMP_IF_FALSE, OP_POP, with
+    //                                 the jump landing past the OP_POP that
+    //                                 the original one landed on
+    //   OP_GET_THIS_PROPERTY n ic     OP_GET_LOCAL 0, OP_GET_PROPERTY n ic
+    OP_GET_LOCAL_LOCAL,
+    OP_ADD_LOCAL_CONSTANT,
+    OP_LESS_JUMP_IF_FALSE,
+    OP_GET_THIS_PROPERTY,
+    // never emitted, the VM rewrites OP_ADD and OP_LESS into these once it
+    // has seen their operand types, see QUICKEN
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_LESS_NUM,
+    // register form, only emitted with the register backend. Operands name
+    // frame slots the way OP_GET_LOCAL does, or constants, see
+    // REGISTER_CONSTANT. A dst of 0 pushes the result instead of storing it
+    //   OP_R_ADD dst a b  (and the other arithmetic and comparisons)
+    //   OP_R_MOVE dst a
+    //   OP_R_LESS_JUMP a b offset   jumps when !(a < b), like
+    //                               OP_LESS_JUMP_IF_FALSE
+    OP_R_ADD,
+    OP_R_SUBTRACT,
+    OP_R_MULTIPLY,
+    OP_R_DIVIDE,
+    OP_R_LESS,
+    OP_R_GREATER,
+    OP_R_MOVE,
+    OP_R_LESS_JUMP,
 };
 
+#define MAX_LONG_OPERAND ((1 << 24) - 1)
+// Register operand encoding: slots 0 to REGISTER_STACK - 1, the value
+// popped off the stack, or REGISTER_CONSTANT | index for the first 128
+// constants.
+#define REGISTER_STACK 0x7f
+#define REGISTER_CONSTANT 0x80
+
 class Chunk{
     public:
         void writeChunk(uint8_t, int);
-        void writeValue(value_t, int);
+        // Drops every byte from offset size on, used by the compiler to
+        // replace instructions it has just emitted.
+        void truncate(int size);
+        // Swaps in rewritten code, which must keep the same constants
+        // and caches.
+        void replaceCode(chunk_array code, line_array lines);
+        // Size in bytes of the instruction at offset, operands included.
+        int instructionLength(int offset);
         chunk_array* getChunk();
+        // The code to execute: either the bytes written so far or a
+        // read-only range of a mapped .levc image.
+        const uint8_t* getCode(){ return mappedCode != NULL ? mappedCode : chunk_stack->data(); }
+        size_t getCodeSize(){ return mappedCode != NULL ? mappedSize : chunk_stack->size(); }
+        bool isMapped(){ return mappedCode != NULL; }
+        void mapCode(const uint8_t* code, size_t size, line_array lines);
         value_t getValue(int);
+        value_t* getValues(){ return value.data(); }
         int getValueSize();
         int getLine(int);
-        uint8_t addConstantToValue(value_t);
+        const line_array& getLines(){ return *line_stack; }
+        int addConstantToValue(value_t);
+        int addCache();
+        InlineCache* getCache(int index){ return &caches[index]; }
+        int getCacheSize(){ return caches.size(); }
         Chunk(){
             chunk_stack = std::make_unique<chunk_array>();
             line_stack = std::make_unique<line_array>();
         }
 
     private:
+        void writeLine(int line);
         std::unique_ptr<line_array> line_stack;
         std::unique_ptr<chunk_array> chunk_stack;
+        // not owned, the image outlives every function loaded from it
+        const uint8_t* mappedCode{NULL};
+        size_t mappedSize{0};
         Value value;
+        // indexed by the 16-bit operand of property and invoke instructions
+        std::vector<InlineCache> caches;
 };
 
 
@@ -7,6 +7,8 @@
 
 // #define DEBUG_TRACE_EXECUTION
 // #define DEBUG_PRINT_CODE
+// #define DEBUG_STRESS_GC
+// #define DEBUG_LOG_GC
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 #endif
\ No newline at end of file
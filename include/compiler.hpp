@@ -9,6 +9,7 @@
 #include "common.hpp"
 #include "debug.hpp"
 #include "object.hpp"
+#include "memory.hpp"
 #define UINT8_COUNT (UINT8_MAX + 1)
 
 
@@ -54,6 +55,14 @@ struct Local{
 
 class Compiler;
 
+// An instruction that only pushes a known value: OP_CONSTANT, OP_NIL,
+// OP_TRUE or OP_FALSE occupying bytes [start, end) of the chunk.
+struct EmittedLiteral{
+    int start;
+    int end;
+    value_t value;
+};
+
 struct Upvalue{
     uint8_t index;
     bool isLocal;
@@ -61,12 +70,25 @@ struct Upvalue{
 
 struct CompilerState{
     ObjFunction* function;
-    FunctionType type;
+    FunctionType type{TYPE_SCRIPT};
 
     Local locals[UINT8_COUNT];
     int localCount{0};
     int scopeDepth{0};
     Upvalue upvalues[UINT8_COUNT];
+
+    // pool index of each number (by bit pattern) and string already in
+    // function's chunk, so that repeated literals and names share a slot
+    std::unordered_map<uint64_t, int> numberConstants;
+    std::unordered_map<ObjString*, int, ObjStringHash> stringConstants;
+
+    // literals ending at the current end of the chunk, with no other
+    // instruction between them, which an operator may fold
+    std::vector<EmittedLiteral> literals;
+    // offsets of the OP_NOT instructions at the end of the chunk
+    std::vector<int> nots;
+    // nothing before this offset may be rewritten, a jump lands here
+    int jumpTarget{0};
 };
 
 struct ClassCompiler{
@@ -78,11 +100,13 @@ class Compiler{
     public:
         ObjFunction* compile(std::string);
         void setCurrent(Compiler* compiler);
-        Compiler(std::string source) : scanner(&source){
+        // registers selects the register backend, see optimizeChunk
+        Compiler(std::string source, GarbageCollector* gc, GlobalTable* globals, bool registers=false)
+        : source(source), scanner(&this->source), gc(gc), globals(globals), registers(registers){
             init_rules();
-            compilerState.function = new ObjFunction;
+            compilerState.function = gc->allocateObject<ObjFunction>();
             compilerState.function->chunk = std::make_unique<Chunk>();
-            source = source;
+            gc->pushRoot((Obj*)compilerState.function);
             currentCompiler = this;
             encloseCompiler=NULL;
             }
@@ -98,6 +122,8 @@ class Compiler{
         void errorAt(Token* token, std::string message);
         void consume(TokenType type, std::string message);
         void emitByte(uint8_t byte);
+        void emitCache();
+        void emitIndexed(uint8_t shortOp, uint8_t longOp, int index);
         void expression();
         bool match(TokenType);
         bool check(TokenType);
@@ -121,18 +147,26 @@ class Compiler{
         void declaration();
         void classDeclaration();
         void synchronize();
-        void defineVariable(uint8_t);
+        void defineVariable(int);
         void and_(bool);
         void or_(bool);
         void this_(bool);
         void super_(bool canAssign);
-        uint8_t identifierConstant(Token*);
+        int identifierConstant(Token*);
+        int globalSlot(Token*);
         void namedVariable(Token, bool);
         ObjFunction* endCompiler();
         void emitReturn();
         void emitByte();
         void emitLoop(int);
         void emitConstant(value_t input_val);
+        void emitLiteral(value_t val);
+        void emitOperator(uint8_t op);
+        bool foldUnary(uint8_t op);
+        bool foldBinary(uint8_t op);
+        int emitConditionJump();
+        int markLoopStart();
+        void rewind(int offset);
         int emitJump(uint8_t);
         void patchJump(int);
         void grouping();
@@ -147,23 +181,26 @@ class Compiler{
         void addLocal(Token);
         void identifierEqual();
         void markInitialized();
-        uint8_t parseVariable(std::string);
+        int parseVariable(std::string);
         bool identifierEqual(Token*, Token*);
         void parsePrecedence(Precedence precedence);
         void init_rules();
-        uint8_t makeConstant(value_t input_val);
+        int makeConstant(value_t input_val);
         ParseRule* getRule(TokenType type);
         int resolveLocal(CompilerState* , Token* );
         int resolveUpvalue(Compiler*, Token*);
         int addUpvalue(Compiler*, uint8_t, bool);
         Chunk* currentChunk();
+        std::string source;
         Parser parser;
         Scanner scanner;
+        GarbageCollector* gc;
+        GlobalTable* globals;
+        bool registers;
         std::unordered_map<TokenType, ParseRule> rules;
         CompilerState compilerState;
         Compiler* currentCompiler;
         Compiler* encloseCompiler;
-        std::string source;
         ClassCompiler* currentClass{NULL};
 };
 
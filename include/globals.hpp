@@ -0,0 +1,30 @@
+#ifndef LEVI_GLOBALS_H
+#define LEVI_GLOBALS_H
+
+#include <vector>
+#include <unordered_map>
+#include "value.hpp"
+#include "object.hpp"
+
+// Global variables live in a dense array. The compiler resolves each name to
+// its index once, and slots that have not been defined yet hold
+// UNDEFINED_VAL so that late-bound names still fail at runtime.
+class GlobalTable{
+    public:
+        int resolve(ObjString* name){
+            auto slot = slots.find(name);
+            if(slot != slots.end()) return slot->second;
+            int index = names.size();
+            slots[name] = index;
+            names.push_back(name);
+            values.push_back(UNDEFINED_VAL);
+            return index;
+        }
+        int size(){ return names.size(); }
+        std::vector<ObjString*> names;
+        std::vector<value_t> values;
+    private:
+        std::unordered_map<ObjString*, int, ObjStringHash> slots;
+};
+
+#endif
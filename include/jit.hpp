@@ -0,0 +1,64 @@
+#ifndef LEVI_JIT_H
+#define LEVI_JIT_H
+
+#include <cstdint>
+#include <vector>
+#include "value.hpp"
+
+// The opcode profile and the execution trace want to see every instruction
+// the interpreter executes, so they keep everything in it.
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__)) \
+    && !defined(NO_JIT) && !defined(OPCODE_PROFILE) && !defined(DEBUG_TRACE_EXECUTION)
+#define JIT_X64
+#endif
+
+// calls after which a function is compiled to machine code
+#define JIT_THRESHOLD 100
+// backward jumps to a loop header after which a trace of the loop is
+// recorded
+#define TRACE_THRESHOLD 50
+
+struct JitConfig{
+    bool enabled{true};
+    uint32_t threshold{JIT_THRESHOLD};
+    bool traces{true};
+    uint32_t traceThreshold{TRACE_THRESHOLD};
+};
+
+// Machine code of one function, owned by the function.
+struct JitCode{
+    uint8_t* code{NULL};
+    size_t size{0};
+    // offset into code of the instruction starting at each bytecode offset
+    std::vector<uint32_t> entries;
+    JitCode(){}
+    JitCode(const JitCode&) = delete;
+    JitCode& operator=(const JitCode&) = delete;
+    ~JitCode();
+};
+
+struct ObjFunction;
+struct CallFrame;
+class VirtualMachine;
+
+// Baseline compiler from bytecode to x86-64, one template per instruction.
+//
+// Compiled code keeps the stack top and the frame's slots in registers and
+// handles the common case of each instruction inline, calling the Runtime
+// helpers for the rest. Calls, returns, class definitions and every slow
+// path that could raise an error are left to the interpreter: the code
+// stores the address of that instruction in the frame and returns, and
+// the interpreter executes it before entering the compiled code again at
+// the next call, return or backward jump.
+class Jit{
+    public:
+        // Returns false when no code could be generated, the function
+        // then keeps running in the interpreter.
+        static bool compile(VirtualMachine* vm, ObjFunction* function);
+        // Runs the frame's compiled code from frame->ip until it reaches
+        // an instruction left to the interpreter, and returns the stack
+        // top at that point. frame->ip is then that instruction.
+        static value_t* execute(VirtualMachine* vm, CallFrame* frame, value_t* sp);
+};
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef LEVI_LEVC_H
+#define LEVI_LEVC_H
+
+#include <string>
+#include <cstdint>
+#include "object.hpp"
+#include "memory.hpp"
+#include "globals.hpp"
+
+// A .levc file holds the compiled form of a script so that later runs can
+// skip the compiler:
+//
+//   "LEVC"  u32 version  u64 source hash  u32 flags  u32 code section offset
+//   u32 global count, then each global name in slot order
+//   the script function
+//   code section
+//
+// A function is its name, arity, upvalue count, the offset and size of its
+// code within the code section, its line runs, its inline cache count and
+// its constants. A constant is a tag byte followed by a number,
+// a string or a nested function. All integers are little endian.
+//
+// The code of every function is stored contiguously in the code section,
+// so a mapped image can be executed in place and its pages are shared by
+// every process running the same script. Each function is run through
+// verifyFunction when it is loaded, and a file that fails is compiled again.
+#define LEVC_MAGIC "LEVC"
+// bump whenever the instruction encoding or the layout above changes
+#define LEVC_VERSION 9
+#define LEVC_CODE_ALIGN 16
+// flags, a file is only loaded by a VM compiling with the same ones
+#define LEVC_REGISTERS 1
+
+enum LevcConstant{
+    LEVC_NIL,
+    LEVC_FALSE,
+    LEVC_TRUE,
+    LEVC_NUMBER,
+    LEVC_STRING,
+    LEVC_FUNCTION
+};
+
+// A .levc file mapped read-only into memory, or read into a buffer where
+// mmap is not available.
+class LevcImage{
+    public:
+        bool open(std::string path);
+        const uint8_t* data(){ return bytes; }
+        size_t size(){ return length; }
+        LevcImage(){}
+        LevcImage(const LevcImage&) = delete;
+        LevcImage& operator=(const LevcImage&) = delete;
+        ~LevcImage();
+    private:
+        const uint8_t* bytes{NULL};
+        size_t length{0};
+        bool mapped{false};
+        std::string buffer;
+};
+
+class LevcWriter{
+    public:
+        // 64-bit FNV-1a of the source, stored in the header.
+        static uint64_t hashSource(const std::string& source);
+        // Returns false if the file could not be written.
+        bool write(std::string path, uint64_t sourceHash, uint32_t flags, ObjFunction* function);
+        LevcWriter(GlobalTable* globals) : globals(globals){}
+    private:
+        void writeFunction(ObjFunction* function);
+        void writeByte(uint8_t byte){ out.push_back((char)byte); }
+        void writeU32(uint32_t value);
+        void writeU64(uint64_t value);
+        void writeString(const std::string& strs);
+        GlobalTable* globals;
+        std::string out;
+        std::string code;
+};
+
+class LevcReader{
+    public:
+        // Returns the script function stored in image, or NULL if it was
+        // written for another source, version or flags. The functions
+        // execute their code in place, so image must outlive them.
+        ObjFunction* read(LevcImage* image, uint64_t sourceHash, uint32_t flags);
+        LevcReader(GarbageCollector* gc, GlobalTable* globals) : gc(gc), globals(globals){}
+    private:
+        ObjFunction* readFunction();
+        value_t readConstant();
+        uint8_t readByte();
+        uint32_t readU32();
+        uint64_t readU64();
+        std::string readString();
+        GarbageCollector* gc;
+        GlobalTable* globals;
+        const uint8_t* in{NULL};
+        size_t size{0};
+        size_t pos{0};
+        const uint8_t* codeSection{NULL};
+        size_t codeSize{0};
+        // set by any read past the end, unknown constant tag, or count or
+        // offset out of the range the compiler can produce
+        bool failed{false};
+};
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef LEVI_MEMORY_H
+#define LEVI_MEMORY_H
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <iostream>
+#include "common.hpp"
+#include "value.hpp"
+#include "object.hpp"
+#include "globals.hpp"
+
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+#define GC_NURSERY_SIZE (256 * 1024)
+#define GC_SLICE_BUDGET 512
+#define GC_PAUSE_BUCKETS 16
+
+class VirtualMachine;
+
+struct InternKey{
+    std::string_view chars;
+    uint32_t hash;
+    bool operator==(const InternKey& other) const { return chars == other.chars; }
+};
+
+struct InternKeyHash{
+    size_t operator()(const InternKey& key) const { return key.hash; }
+};
+
+struct GcConfig{
+    size_t initialThreshold{GC_INITIAL_THRESHOLD};
+    double growFactor{GC_HEAP_GROW_FACTOR};
+    // 0 disables the nursery, every object is then allocated old
+    size_t nurserySize{GC_NURSERY_SIZE};
+    // mark and sweep in slices of at most sliceBudget objects instead of
+    // stopping the world, the nursery is not used in this mode
+    bool incremental{false};
+    size_t sliceBudget{GC_SLICE_BUDGET};
+};
+
+enum GcPhase{
+    GC_IDLE,
+    GC_MARKING,
+    GC_SWEEPING
+};
+
+struct GcStats{
+    size_t totalAllocated{0};
+    size_t totalFreed{0};
+    size_t collections{0};
+    size_t minorCollections{0};
+    size_t totalPromoted{0};
+    double totalPause{0};  // seconds
+    double maxPause{0};    // seconds
+    size_t slices{0};
+    // bucket i counts pauses shorter than 2^i microseconds,
+    // the last bucket also takes everything longer
+    size_t pauseHistogram[GC_PAUSE_BUCKETS]{};
+};
+
+class GarbageCollector{
+    public:
+        template<typename T, typename... Args>
+        T* allocateObject(Args&&... args){
+            collectIfNeeded();
+            T* object = new T(std::forward<Args>(args)...);
+            track((Obj*)object);
+            return object;
+        }
+        // Returns the interned string with these characters, allocating it
+        // the first time they are seen.
+        ObjString* copyString(std::string strs);
+        void collectGarbage();
+        void collectNursery();
+        // Called by the interpreter at backward jumps so that a cycle in
+        // progress keeps advancing even when the script does not allocate.
+        inline void safepoint(){
+            if(phase != GC_IDLE) step();
+        }
+        // Must be called whenever a reference to val is stored into owner,
+        // so that old objects pointing at young ones are scanned by the next
+        // minor collection.
+        inline void writeBarrier(Obj* owner, value_t val){
+            if(owner->isOld && !owner->isRemembered && IS_OBJ(val) && !AS_OBJ(val)->isOld){
+                owner->isRemembered = true;
+                rememberedSet.push_back(owner);
+            }
+            // keep the tri-color invariant: nothing already marked may point
+            // at a white object while a cycle is marking
+            if(phase == GC_MARKING && owner->isMarked && IS_OBJ(val) && !AS_OBJ(val)->isMarked){
+                markObject(AS_OBJ(val));
+            }
+        }
+        // Same as writeBarrier for a global variable slot, covering both its
+        // name and its value. Globals are only scanned in full by a major
+        // collection.
+        inline void writeBarrier(GlobalTable* globals, int slot){
+            Obj* name = (Obj*)globals->names[slot];
+            value_t val = globals->values[slot];
+            if(!name->isOld || (IS_OBJ(val) && !AS_OBJ(val)->isOld)){
+                rememberedGlobals.push_back(slot);
+            }
+            if(phase == GC_MARKING){
+                if(!name->isMarked) markObject(name);
+                if(IS_OBJ(val) && !AS_OBJ(val)->isMarked) markObject(AS_OBJ(val));
+            }
+        }
+        void pushRoot(Obj* object){ roots.push_back(object); }
+        void popRoot(){ roots.pop_back(); }
+        void markValue(value_t val);
+        void markObject(Obj* object);
+        void printStats(std::ostream& out);
+        size_t getBytesAllocated(){ return bytesAllocated; }
+        GarbageCollector(VirtualMachine* vm, GcConfig config=GcConfig())
+        : vm(vm), config(config), nextGC(config.initialThreshold){
+            if(config.incremental) this->config.nurserySize = 0;
+        }
+        ~GarbageCollector();
+    private:
+        friend class Jit;
+        friend class Tracer;
+        void collectIfNeeded();
+        void track(Obj* object);
+        void markRoots();
+        void traceReferences();
+        void blackenObject(Obj* object);
+        void sweep();
+        void sweepNursery();
+        void clearRemembered();
+        void freeObject(Obj* object);
+        void removeWhiteStrings();
+        void startCycle();
+        void step();
+        void finishMarking();
+        void sweepSlice(size_t budget);
+        void finishCycle();
+        void recordPause(double seconds);
+        static size_t objectSize(Obj* object);
+        VirtualMachine* vm;
+        GcConfig config;
+        GcStats stats;
+        Obj* objects{NULL};
+        Obj* youngObjects{NULL};
+        std::vector<Obj*> rememberedSet;
+        std::vector<int> rememberedGlobals;
+        int shapesMarked{0};
+        bool minorCollection{false};
+        GcPhase phase{GC_IDLE};
+        Obj** sweepLink{NULL};
+        std::vector<Obj*> grayStack;
+        // weak, an entry goes away with its string
+        std::unordered_map<InternKey, ObjString*, InternKeyHash> strings;
+        std::vector<Obj*> roots;
+        size_t bytesAllocated{0};
+        size_t youngBytes{0};
+        size_t nextGC;
+};
+
+#endif
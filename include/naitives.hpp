@@ -4,6 +4,7 @@
 #include "object.hpp"
 #include "time.h"
 
-value_t clockNative(int argCount, stack_iter args);
+value_t clockNative(VirtualMachine* vm, int argCount, value_t* args);
+value_t flushNative(VirtualMachine* vm, int argCount, value_t* args);
 
 #endif
\ No newline at end of file
@@ -7,6 +7,8 @@
 #include "common.hpp"
 #include "value.hpp"
 #include "chunk.hpp"
+#include "jit.hpp"
+#include "trace.hpp"
 // #include "vm.hpp"
 
 #define OBJ_TYPE(value)    (AS_OBJ(value)->type)
@@ -22,16 +24,24 @@
 #define AS_STRING(value)   ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)  (((ObjString*)AS_OBJ(value))->strs)
 #define AS_FUNCTION(value)  (((ObjFunction*)AS_OBJ(value)))
-#define AS_NATIVE(value)  (((ObjNative*)AS_OBJ(value))->function)
+#define AS_NATIVE(value)  ((ObjNative*)AS_OBJ(value))
 #define AS_CLOSURE(value)  ((ObjClosure*)AS_OBJ(value))
 #define AS_CLASS(value)  ((ObjClass*)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
 
 using stack_array = std::vector<value_t>;
 using stack_iter = stack_array::iterator;
-using NativeFn = std::function<value_t(int, stack_iter)>;
+// Natives are called with the arguments in place on the VM stack, args[0]
+// being the first of argCount.
+using NativeFn = value_t (*)(VirtualMachine* vm, int argCount, value_t* args);
+// arity of a native that takes any number of arguments
+#define NATIVE_ANY_ARITY (-1)
+// A function of a script translated ahead of time, called like
+// Jit::execute, see aot.hpp.
+using AotFunction = value_t* (*)(VirtualMachine*, CallFrame*, value_t*);
 
 struct ObjUpvalue;
+struct Shape;
 
 enum ObjType{
     OBJ_BOUND_METHOD,
@@ -46,28 +56,56 @@ enum ObjType{
 
 struct Obj{
     ObjType type;
+    bool isMarked{false};
+    bool isOld{false};
+    bool isRemembered{false};
+    struct Obj* next{NULL};
 };
 
 struct ObjNative{
-    ObjNative(NativeFn fun){function=fun;}
+    ObjNative(NativeFn function, int arity) : function(function), arity(arity){}
     Obj obj{OBJ_NATIVE};
     NativeFn function;
+    // checked by the call, or NATIVE_ANY_ARITY
+    int arity;
 };
 
 struct ObjFunction{
     Obj obj{OBJ_FUNCTION};
     int arity{0};
     int upvalueCount{0};
+    // the most slots a frame of the function holds at once, slot 0
+    // included, which a call makes room for on the stack
+    int stackSize{0};
     std::unique_ptr<Chunk> chunk;
     std::string name{"main"};
+    // calls so far, the function is compiled once they reach the threshold
+    uint32_t calls{0};
+    std::unique_ptr<JitCode> jit;
+    // backward jumps so far, the loops of the function are looked at for
+    // tracing once they reach the trace threshold
+    uint32_t backEdges{0};
+    std::vector<std::unique_ptr<Trace>> traces;
+    // set when the script was translated ahead of time, it then runs in
+    // place of the machine code
+    AotFunction aot{NULL};
 };
 
 struct ObjString{
     Obj obj{OBJ_STRING};
     int length;
+    uint32_t hash;
     std::string strs;
 };
 
+// Strings are interned, so tables keyed by them can hash with the
+// precomputed hash and compare by pointer.
+struct ObjStringHash{
+    size_t operator()(const ObjString* string) const { return string->hash; }
+};
+
+using StringTable = std::unordered_map<ObjString*, value_t, ObjStringHash>;
+
 struct ObjClosure{
     ObjClosure(ObjFunction* arg_function)
     : upvalues(arg_function->upvalueCount, NULL)
@@ -93,14 +131,19 @@ struct ObjClass{
     ObjClass(ObjString* obj_name) {name=obj_name;}
     Obj obj{OBJ_CLASS};
     ObjString* name;
-    std::unordered_map<std::string, value_t> methods;
+    StringTable methods;
 };
 
 struct ObjInstance{
-    ObjInstance(ObjClass* arg_klass){klass=arg_klass;}
+    ObjInstance(ObjClass* arg_klass, Shape* arg_shape){
+        klass=arg_klass;
+        shape=arg_shape;
+    }
     Obj obj{OBJ_INSTANCE};
     ObjClass* klass;
-    std::unordered_map<std::string, value_t> fields;
+    Shape* shape;
+    // indexed by shape->lookup(name)
+    std::vector<value_t> fields;
 };
 
 struct ObjBoundMethod{
@@ -117,40 +160,50 @@ struct ObjBoundMethod{
 class Object{
     public:
         static void getObjString(std::string strs, ObjString* objString){
-            objString->obj = Obj{OBJ_STRING};
             objString->length = strs.size();
-            objString->strs = strs;
+            objString->hash = hashString(strs.data(), strs.size());
+            objString->strs = std::move(strs);
+        }
+
+        // FNV-1a
+        static uint32_t hashString(const char* key, size_t length){
+            uint32_t hash = 2166136261u;
+            for(size_t i = 0; i < length; i++){
+                hash ^= (uint8_t)key[i];
+                hash *= 16777619;
+            }
+            return hash;
         }
 
         static inline bool isObjType(value_t val, ObjType type){
             return IS_OBJ(val) && AS_OBJ(val)->type == type;
             }
 
-        static void printObject(value_t val){
+        // The text print shows for an object.
+        static std::string toString(value_t val){
             switch(OBJ_TYPE(val)){
                 case OBJ_STRING:
-                    std::cout << AS_CSTRING(val);
-                    break;
+                    return AS_CSTRING(val);
                 case OBJ_FUNCTION:
-                    std::cout << "Function: " << AS_FUNCTION(val)->name;
-                    break;
+                    return "Function: " + AS_FUNCTION(val)->name;
                 case OBJ_NATIVE:
-                    std::cout << "<native fn>";
-                    break;
+                    return "<native fn>";
                 case OBJ_CLOSURE:
-                    std::cout << "<closuer>";
-                    break;
+                    return "<closuer>";
                 case OBJ_UPVALUE:
-                    std::cout << "upvalue";
-                    break;
+                    return "upvalue";
                 case OBJ_CLASS:
-                    std::cout << "class";
-                    break;
+                    return "class";
                 case OBJ_INSTANCE:
-                    std::cout << "instance";
-                    break;
+                    return "instance";
+                default:
+                    return "";
             }
         }
+
+        static void printObject(value_t val){
+            std::cout << toString(val);
+        }
 };
 
 # endif
\ No newline at end of file
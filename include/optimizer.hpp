@@ -0,0 +1,24 @@
+#ifndef LEVI_OPTIMIZER_H
+#define LEVI_OPTIMIZER_H
+
+#include "chunk.hpp"
+
+// Peephole pass run on a function once it has been compiled.
+//
+// Jumps to an OP_JUMP are sent straight to its destination, as are
+// OP_JUMP_IF_FALSEs landing on another OP_JUMP_IF_FALSE, which would test
+// the same value. Then sequences that no jump lands inside are fused into
+// the superinstructions listed with OpCode or, failing that, these pairs:
+//
+//   OP_EQUAL OP_NOT          -> OP_NOT_EQUAL
+//   OP_LESS OP_NOT           -> OP_GREATER_EQUAL
+//   OP_GREATER OP_NOT        -> OP_LESS_EQUAL
+//   OP_SET_LOCAL n OP_POP    -> OP_SET_LOCAL_POP n
+//
+// With registers set, sequences that only combine locals and constants are
+// first translated into the register instructions listed with OpCode.
+//
+// Jump offsets and line runs are rewritten to match the shorter code.
+void optimizeChunk(Chunk* chunk, bool registers=false);
+
+#endif
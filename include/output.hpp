@@ -0,0 +1,53 @@
+#ifndef LEVI_OUTPUT_H
+#define LEVI_OUTPUT_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "value.hpp"
+
+// bytes of print output held before they are written out
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+enum FlushPolicy{
+    // FLUSH_LINE when the output is a terminal, FLUSH_FULL otherwise
+    FLUSH_AUTO,
+    // after every line
+    FLUSH_LINE,
+    // only once the buffer is full, on flush() and when the script ends
+    FLUSH_FULL
+};
+
+struct OutputConfig{
+    // 0 writes every print straight through
+    size_t size{OUTPUT_BUFFER_SIZE};
+    FlushPolicy policy{FLUSH_AUTO};
+};
+
+// Where print writes to, in place of std::cout and its flush per line.
+//
+// Anything else that writes to stdout or stderr while a script runs, such
+// as a runtime error, has to flush the buffer first to keep the order.
+class OutputBuffer{
+    public:
+        OutputBuffer(OutputConfig config=OutputConfig(), FILE* file=stdout);
+        OutputBuffer(const OutputBuffer&) = delete;
+        OutputBuffer& operator=(const OutputBuffer&) = delete;
+        ~OutputBuffer(){ flush(); }
+        void write(const char* data, size_t size);
+        void write(const std::string& text){ write(text.data(), text.size()); }
+        // Numbers come out the way std::cout would print them.
+        void writeNumber(double number);
+        // The same text as Value::printValue.
+        void writeValue(value_t val);
+        // Ends a print.
+        void newline();
+        void flush();
+    private:
+        FILE* file;
+        std::vector<char> buffer;
+        size_t used{0};
+        bool lineBuffered;
+};
+
+#endif
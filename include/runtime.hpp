@@ -0,0 +1,34 @@
+#ifndef LEVI_RUNTIME_H
+#define LEVI_RUNTIME_H
+
+#include <cstdint>
+#include "value.hpp"
+
+class VirtualMachine;
+
+// Slow paths of the instructions, shared by the code the JIT compiles and
+// the code the AOT translator writes.
+//
+// They are called with the stack top and the address of the instruction
+// and return the new stack top, or NULL to leave the instruction to the
+// interpreter.
+class Runtime{
+    public:
+        static value_t* getGlobal(VirtualMachine* vm, value_t* sp, const uint8_t* ip);
+        static value_t* setGlobal(VirtualMachine* vm, value_t* sp, const uint8_t* ip);
+        static value_t* defineGlobal(VirtualMachine* vm, value_t* sp, const uint8_t* ip);
+        static value_t* getUpvalue(VirtualMachine* vm, value_t* sp, const uint8_t* ip);
+        static value_t* setUpvalue(VirtualMachine* vm, value_t* sp, const uint8_t* ip);
+        static value_t* getProperty(VirtualMachine* vm, value_t* sp, const uint8_t* ip);
+        static value_t* setProperty(VirtualMachine* vm, value_t* sp, const uint8_t* ip);
+        static value_t* equal(VirtualMachine* vm, value_t* sp, const uint8_t* ip);
+        static value_t* add(VirtualMachine* vm, value_t* sp, const uint8_t* ip);
+        static value_t* print(VirtualMachine* vm, value_t* sp, const uint8_t* ip);
+        static value_t* closeUpvalue(VirtualMachine* vm, value_t* sp, const uint8_t* ip);
+        static value_t* safepoint(VirtualMachine* vm, value_t* sp, const uint8_t* ip);
+    private:
+        static void storeStack(VirtualMachine* vm, value_t* sp);
+        static value_t* loadStack(VirtualMachine* vm);
+};
+
+#endif
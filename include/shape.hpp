@@ -0,0 +1,59 @@
+#ifndef LEVI_SHAPE_H
+#define LEVI_SHAPE_H
+
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include "object.hpp"
+
+// A shape describes the field layout of an instance: which property lives in
+// which index of ObjInstance::fields. Adding a property moves the instance
+// along a transition to the next shape, so instances that get the same
+// properties in the same order, e.g. everything built by one initializer,
+// share a shape.
+struct Shape{
+    Shape(Shape* parent, ObjString* name) : parent(parent), name(name){
+        if(parent != NULL){
+            slots = parent->slots;
+            slotCount = parent->slotCount;
+        }
+        if(name != NULL){
+            slots[name] = slotCount++;
+        }
+    }
+    int lookup(ObjString* property){
+        auto slot = slots.find(property);
+        return slot == slots.end() ? -1 : slot->second;
+    }
+    Shape* parent;
+    ObjString* name;   // property added by the transition from parent
+    int slotCount{0};
+    std::unordered_map<ObjString*, int, ObjStringHash> slots;
+    std::unordered_map<ObjString*, Shape*, ObjStringHash> transitions;
+};
+
+// Owns every shape. Shapes are never freed, there are only as many as
+// there are distinct property orders in the program.
+class ShapeTable{
+    public:
+        Shape* getRoot(){ return root; }
+        Shape* addProperty(Shape* shape, ObjString* name){
+            auto next = shape->transitions.find(name);
+            if(next != shape->transitions.end()) return next->second;
+            Shape* created = newShape(shape, name);
+            shape->transitions[name] = created;
+            return created;
+        }
+        int size(){ return shapes.size(); }
+        Shape* at(int index){ return shapes[index].get(); }
+        ShapeTable(){ root = newShape(NULL, NULL); }
+    private:
+        Shape* newShape(Shape* parent, ObjString* name){
+            shapes.push_back(std::make_unique<Shape>(parent, name));
+            return shapes.back().get();
+        }
+        std::vector<std::unique_ptr<Shape>> shapes;
+        Shape* root;
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef LEVI_TRACE_H
+#define LEVI_TRACE_H
+
+#include <memory>
+#include "jit.hpp"
+
+// The compiled trace of one loop, owned by the function the loop is in.
+struct Trace{
+    // the instruction the loop jumps back to
+    const uint8_t* header;
+    // backward jumps to the header seen so far
+    uint32_t hits{0};
+    bool recorded{false};
+    uint32_t recordings{0};
+    // the first and last instruction on the recorded path, a guard that
+    // resumes in between leaves the trace for another way through the body
+    const uint8_t* low{NULL};
+    const uint8_t* high{NULL};
+    uint32_t sideExits{0};
+    // NULL until the loop is recorded, and after that if it could not be
+    std::unique_ptr<JitCode> code;
+    Trace(const uint8_t* header) : header(header){}
+};
+
+struct CallFrame;
+class VirtualMachine;
+
+// Compiles hot loops of numeric code to machine code.
+//
+// Once a loop header has been jumped back to often enough the recorder
+// follows one iteration of the loop from the header, the path the current
+// values of the locals would take, and writes down the arithmetic and
+// comparisons on that path. Only numbers, locals and branches can be
+// recorded; a loop that calls, allocates or touches anything else is left
+// to the interpreter for good. The trace is compiled with every local it
+// uses unboxed in an SSE register for the whole loop. Each branch becomes
+// a guard that, when the other way is taken, boxes the locals back into
+// the frame and returns to the interpreter at that side of the branch. A
+// loop that keeps leaving its trace that way is recorded again, along the
+// path it takes by then.
+class Tracer{
+    public:
+        // Runs the trace of the loop whose header is frame->ip, recording
+        // it first if the loop has become hot, and returns the stack top
+        // it left, with frame->ip at the instruction the interpreter
+        // continues with. Returns sp and leaves frame->ip alone when no
+        // trace was run.
+        static value_t* enter(VirtualMachine* vm, CallFrame* frame, value_t* sp);
+    private:
+        static bool record(VirtualMachine* vm, CallFrame* frame, value_t* sp, Trace* trace);
+};
+
+#endif
@@ -5,11 +5,61 @@
 #include "common.hpp"
 #include "vector"
 
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL   1 // 01.
+#define TAG_FALSE 2 // 10.
+#define TAG_TRUE  3 // 11.
+#define TAG_UNDEFINED 4 // 100.
+
+struct Obj;
+struct ObjString;
+
+using value_t = uint64_t;
+
+#define IS_BOOL(value)    (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)     ((value) == NIL_VAL)
+#define IS_NUMBER(value)  (((value) & QNAN) != QNAN)
+#define IS_OBJ(value)     (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+
+#define AS_OBJ(value)     ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+#define AS_BOOL(value)    ((value) == TRUE_VAL)
+#define AS_NUMBER(value)  valueToNum(value)
+
+#define OBJ_VAL(object)   (value_t)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object))
+#define BOOL_VAL(b)       ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL         ((value_t)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL          ((value_t)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL           ((value_t)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL     ((value_t)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(num)   numToValue(num)
+
+static inline double valueToNum(value_t value){
+    double num;
+    memcpy(&num, &value, sizeof(value_t));
+    return num;
+}
+
+static inline value_t numToValue(double num){
+    value_t value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
+
 enum ValueType{
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
-    VAL_OBJ
+    VAL_OBJ,
+    VAL_UNDEFINED  // marks a global slot that has not been defined yet
 };
 
 struct Obj;
@@ -24,12 +74,11 @@ struct value_t{
     } as;
 };
 
-using ValueArray = std::vector<value_t>;
-
 #define IS_BOOL(value)    ((value).type  == VAL_BOOL)
 #define IS_NIL(value)     ((value).type  == VAL_NIL)
 #define IS_NUMBER(value)  ((value).type  == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type  == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type  == VAL_UNDEFINED)
 
 #define AS_OBJ(value)     ((value).as.obj)
 #define AS_BOOL(value)    ((value).as.boolean)
@@ -38,22 +87,24 @@ using ValueArray = std::vector<value_t>;
 #define OBJ_VAL(object)   ((value_t){VAL_OBJ, {.obj=(Obj*)object}})
 #define BOOL_VAL(value)   ((value_t){VAL_BOOL, {.boolean=value}})
 #define NIL_VAL           ((value_t){VAL_NIL, {.number=0}})
+#define UNDEFINED_VAL     ((value_t){VAL_UNDEFINED, {.number=0}})
 #define NUMBER_VAL(value) ((value_t){VAL_NUMBER, {.number=value}})
 
+#endif
+
+using ValueArray = std::vector<value_t>;
+
 
 class Value{
     public:
-        uint8_t addConstant(value_t value);
+        int addConstant(value_t value);
         value_t getElement(int index);
         static bool valuesEqual(value_t, value_t);
+        value_t* data(){ return value_stack.data(); }
         int getValueStackSize(){
             return value_stack.size();
         }
         static void printValue(value_t);
-        template< typename T>
-        static inline value_t obj_val(std::unique_ptr<T> object){
-            return value_t{VAL_OBJ, .obj=std::move(static_cast<std::unique_ptr<Obj>>(object))};
-        }
     private:
         ValueArray value_stack;
 };
@@ -0,0 +1,23 @@
+#ifndef LEVI_VERIFIER_H
+#define LEVI_VERIFIER_H
+
+#include "object.hpp"
+
+// Checks the code of a function before the VM dispatches on it unchecked,
+// and works out how much stack its frames need. The compiler's output
+// always passes, code mapped from a .levc file may not.
+//
+// Every instruction has to be a known opcode lying wholly inside the code,
+// and its constant, cache, global and upvalue operands have to exist, with
+// constants of the type the instruction expects. Jumps have to land on an
+// instruction. Then, along every path from the entry, each instruction has
+// to find the values it pops and the locals it names on the frame's stack,
+// the stack has to be the same height however an instruction is reached,
+// and no path may run off the end of the code.
+//
+// Nested functions among the constants have to be verified first. Returns
+// the most slots the frame's stack holds at once, slot 0 included, which
+// becomes the function's stackSize, or -1 if any check fails.
+int verifyFunction(ObjFunction* function, int globalCount);
+
+#endif
@@ -9,17 +9,49 @@
 #include "common.hpp"
 #include "debug.hpp"
 #include "naitives.hpp"
+#include "memory.hpp"
+#include "shape.hpp"
+#include "levc.hpp"
+#include "jit.hpp"
+#include "trace.hpp"
+#include "output.hpp"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+struct AotModule;
+
+// call depth at which a script fails with "Stack overflow", see StackConfig
+#define FRAMES_MAX 65536
+// frames and stack slots allocated up front, both grow as calls nest
+// deeper
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL (4 * UINT8_COUNT)
+// a traceback of a deeper stack shows only this many of the outermost and
+// of the innermost calls
+#define TRACEBACK_CALLS 10
+
+struct StackConfig{
+    uint32_t maxFrames{FRAMES_MAX};
+};
 
 using stack_array = std::vector<value_t>;
 using stack_iter = stack_array::iterator;
 
 
+#ifdef OPCODE_PROFILE
+// How often each instruction was followed by each other one, indexed by
+// [previous][next] opcode.
+struct OpcodeProfile{
+    uint64_t counts[UINT8_COUNT][UINT8_COUNT]{};
+    uint8_t previous{OP_RETURN};
+    void record(uint8_t op){
+        counts[previous][op]++;
+        previous = op;
+    }
+};
+#endif
+
 struct CallFrame{
     ObjClosure* closure;
-    chunk_iter ip;
+    const uint8_t* ip;
     stack_iter slots;
 };
 
@@ -31,38 +63,87 @@ enum InterpretResult{
 
 class VirtualMachine{
     public:
-        InterpretResult interpret(Chunk* chunk);
         InterpretResult interpret(std::string source);
+        InterpretResult interpret(std::string source, std::string cachePath);
+        // Runs source with the functions translated into module, or in the
+        // interpreter if module was translated from another script.
+        InterpretResult interpret(std::string source, const AotModule* module);
+        // Writes the C++ translation of source to path, see AotWriter.
+        // Returns false on a compile error or if path can't be written.
+        bool translate(std::string source, std::string path);
         InterpretResult run();
         void stack_push(value_t);
-        VirtualMachine(): stack_ptr(0){
-            stack_memory = std::make_unique<stack_array>(STACK_MAX);
+        void printGcStats(std::ostream& out){ gc.printStats(out); }
+        void printCacheStats(std::ostream& out);
+        void printOpcodePairs(std::ostream& out, size_t limit);
+        // Writes out what print has buffered so far.
+        void flushOutput(){ output.flush(); }
+        // registers compiles for the register backend, see optimizeChunk
+        VirtualMachine(GcConfig gcConfig=GcConfig(), bool registers=false,
+                       JitConfig jitConfig=JitConfig(), OutputConfig outputConfig=OutputConfig(),
+                       StackConfig stackConfig=StackConfig())
+        : stack_ptr(0), frames(FRAMES_INITIAL), registers(registers), jitConfig(jitConfig),
+          stackConfig(stackConfig), output(outputConfig), gc(this, gcConfig){
+            stack_memory = std::make_unique<stack_array>(STACK_INITIAL);
             stack_ptr = stack_memory->begin();
-            defineNative("clock", clockNative);
+            initString = gc.copyString("init");
+            defineNative("clock", clockNative, 0);
+            defineNative("flush", flushNative, 0);
         }
     private:
+        friend class GarbageCollector;
+        friend class Jit;
+        friend class Runtime;
+        friend class Tracer;
         chunk_iter ip;
         std::unique_ptr<stack_array> stack_memory;
         stack_iter stack_ptr;
+        ObjFunction* compile(std::string source);
+        InterpretResult interpret(ObjFunction* function);
         value_t stack_pop();
         value_t peek(int);
         bool isFalsey(value_t val);
         void runtimeError(std::string format);
         void concatenate();
         bool call(ObjClosure*, int);
-        bool invokeFromClass(ObjClass* , ObjString* ,int);
-        bool invoke(ObjString* , int);
+        // Moves the stack to a larger allocation with room for needed
+        // slots above stack_ptr. Every iterator and pointer into the old
+        // one, frame slots and open upvalues included, is relocated;
+        // callers reload their copies of the stack top.
+        void growStack(size_t needed);
+        bool invokeFromClass(ObjClass* , ObjString* ,int, InlineCache*);
+        bool invoke(ObjString* , int, InlineCache*);
+        CacheEntry* cacheMiss(InlineCache*);
+        void cacheMethod(CacheEntry*, Shape*, ObjClass*, ObjClosure*);
         bool callValue(value_t callee, int argCount);
+        bool callNative(ObjNative* native, int argCount);
         bool bindMethod(ObjClass*, ObjString*);
         void defineMethod(ObjString* );
-        void defineNative(std::string name, NativeFn function);
+        // The arity, unless it is NATIVE_ANY_ARITY, is checked before each
+        // call so the native itself does not have to.
+        void defineNative(std::string name, NativeFn function, int arity);
         ObjUpvalue* captureUpvalue(value_t*);
         void closeUpvalues(value_t*);
         Obj* object;
-        std::unordered_map<std::string, value_t> globals_table;
-        CallFrame frames[FRAMES_MAX];
+        GlobalTable globals;
+        ShapeTable shapes;
+        CacheStats cacheStats;
+#ifdef OPCODE_PROFILE
+        std::unique_ptr<OpcodeProfile> opcodeProfile{std::make_unique<OpcodeProfile>()};
+#endif
+        // grown on demand, so a CallFrame* is only good until the next call
+        std::vector<CallFrame> frames;
         int frameCount{0};
         ObjUpvalue* openUpvalues{NULL};
+        ObjString* initString{NULL};
+        bool registers;
+        JitConfig jitConfig;
+        StackConfig stackConfig;
+        // images that loaded functions execute from, released after gc
+        // has freed those functions
+        std::vector<std::unique_ptr<LevcImage>> images;
+        OutputBuffer output;
+        GarbageCollector gc;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,134 @@
+#ifndef LEVI_X64_H
+#define LEVI_X64_H
+
+#include <cstring>
+#include <cstddef>
+#include "jit.hpp"
+
+#ifdef JIT_X64
+
+enum Register{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+enum Condition{
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+    CC_P = 0xa,
+    CC_NP = 0xb
+};
+
+#define VALUE_SIZE ((int32_t)sizeof(value_t))
+#ifdef NAN_BOXING
+#define PAYLOAD 0
+#else
+#define PAYLOAD ((int32_t)offsetof(value_t, as))
+#endif
+
+// SSE opcodes of the scalar double operations
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SUB 0x5c
+#define SSE_DIV 0x5e
+
+// A value in memory at base + disp.
+struct Location{
+    int base;
+    int32_t disp;
+};
+
+// Encodes the x86-64 instructions the compilers use into a buffer. Every
+// memory operand is encoded as [base + disp32].
+class X64Assembler{
+    public:
+        // Resolves the jumps and copies the code into executable memory.
+        bool install(JitCode* jit);
+    protected:
+        void byte(uint8_t value){ out.push_back(value); }
+        void u32(uint32_t value){ for(int i = 0; i < 4; i++) byte((value >> (8 * i)) & 0xff); }
+        void u64(uint64_t value){ for(int i = 0; i < 8; i++) byte((value >> (8 * i)) & 0xff); }
+        void rex(bool wide, int reg, int base){
+            uint8_t prefix = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (base >> 3);
+            if(prefix != 0x40) byte(prefix);
+        }
+        void mem(int reg, int base, int32_t disp){
+            byte(0x80 | ((reg & 7) << 3) | (base & 7));
+            if((base & 7) == RSP) byte(0x24);
+            u32(disp);
+        }
+        void modrm(int reg, int rm){ byte(0xc0 | ((reg & 7) << 3) | (rm & 7)); }
+
+        void load(int reg, int base, int32_t disp){ rex(true, reg, base); byte(0x8b); mem(reg, base, disp); }
+        void store(int base, int32_t disp, int reg){ rex(true, reg, base); byte(0x89); mem(reg, base, disp); }
+        void loadAddress(int reg, int base, int32_t disp){ rex(true, reg, base); byte(0x8d); mem(reg, base, disp); }
+        void move(int dst, int src){ rex(true, src, dst); byte(0x89); modrm(src, dst); }
+        void moveImmediate(int reg, uint64_t value){ rex(true, 0, reg); byte(0xb8 | (reg & 7)); u64(value); }
+        void addImmediate(int reg, int32_t value){ rex(true, 0, reg); byte(0x81); modrm(0, reg); u32(value); }
+        // op r/m64, r64 for add (0x01), or (0x09), and (0x21), xor (0x31),
+        // cmp (0x39) and test (0x85)
+        void alu(uint8_t op, int rm, int reg){ rex(true, reg, rm); byte(op); modrm(reg, rm); }
+        void compareDword(int base, int32_t disp, uint32_t value){ rex(false, 0, base); byte(0x81); mem(7, base, disp); u32(value); }
+        void compareByte(int base, int32_t disp, uint8_t value){ rex(false, 0, base); byte(0x80); mem(7, base, disp); byte(value); }
+        // sign extended to 64 bits
+        void storeImmediate(int base, int32_t disp, int32_t value){ rex(true, 0, base); byte(0xc7); mem(0, base, disp); u32(value); }
+        // prefix 0 for none, 0xf2 for scalar double and 0x66 for packed
+        // double and ucomisd
+        void sse(uint8_t prefix, uint8_t op, int xmm, int base, int32_t disp){
+            if(prefix != 0) byte(prefix);
+            rex(false, xmm, base);
+            byte(0x0f);
+            byte(op);
+            mem(xmm, base, disp);
+        }
+        void sseRegisters(uint8_t prefix, uint8_t op, int xmm, int src){
+            if(prefix != 0) byte(prefix);
+            rex(false, xmm, src);
+            byte(0x0f);
+            byte(op);
+            modrm(xmm, src);
+        }
+        // movq xmm, r64
+        void moveToXmm(int xmm, int reg){ byte(0x66); rex(true, xmm, reg); byte(0x0f); byte(0x6e); modrm(xmm, reg); }
+        void setAl(Condition cc){ byte(0x0f); byte(0x90 | cc); byte(0xc0); }
+        void push(int reg){ if(reg >= R8) byte(0x41); byte(0x50 | (reg & 7)); }
+        void pop(int reg){ if(reg >= R8) byte(0x41); byte(0x58 | (reg & 7)); }
+        void callRegister(int reg){ rex(false, 0, reg); byte(0xff); modrm(2, reg); }
+        void jumpRegister(int reg){ rex(false, 0, reg); byte(0xff); modrm(4, reg); }
+        void ret(){ byte(0xc3); }
+
+        int newLabel(){ labels.push_back(-1); return labels.size() - 1; }
+        void bind(int label){ labels[label] = out.size(); }
+        bool bound(int label){ return labels[label] >= 0; }
+        void jump(int label){ byte(0xe9); fixup(label); }
+        void jumpIf(Condition cc, int label){ byte(0x0f); byte(0x80 | cc); fixup(label); }
+
+        void copyValue(Location dst, Location src);
+        void storeValue(Location dst, value_t val);
+        void checkNumber(Location val, int fail);
+        void loadNumber(Location val, int xmm=0);
+        void storeNumber(Location dst, int xmm=0);
+        void storeBool(Location dst);
+        void branchIfFalsey(Location val, int label);
+
+        std::vector<uint8_t> out;
+    private:
+        void fixup(int label){
+            fixups.push_back(Fixup{(int)out.size(), label});
+            u32(0);
+        }
+        struct Fixup{
+            int at;
+            int label;
+        };
+        std::vector<int> labels;
+        std::vector<Fixup> fixups;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,369 @@
+#include "aot.hpp"
+#include "levc.hpp"
+#include "debug.hpp"
+#include <fstream>
+#include <cstdio>
+#include <cmath>
+
+static void collectFunctions(ObjFunction* function, std::vector<ObjFunction*>& functions){
+    functions.push_back(function);
+    Chunk* chunk = function->chunk.get();
+    for(int i = 0; i < chunk->getValueSize(); i++){
+        value_t val = chunk->getValue(i);
+        if(IS_FUNCTION(val)) collectFunctions(AS_FUNCTION(val), functions);
+    }
+}
+
+std::vector<ObjFunction*> Aot::functions(ObjFunction* script){
+    std::vector<ObjFunction*> functions;
+    collectFunctions(script, functions);
+    return functions;
+}
+
+static uint64_t hashCode(ObjFunction* function){
+    Chunk* chunk = function->chunk.get();
+    return LevcWriter::hashSource(std::string((const char*)chunk->getCode(), chunk->getCodeSize()));
+}
+
+bool Aot::attach(ObjFunction* script, const AotModule* module){
+    std::vector<ObjFunction*> functions = Aot::functions(script);
+    if(functions.size() != module->functionCount) return false;
+    for(size_t i = 0; i < functions.size(); i++){
+        if(hashCode(functions[i]) != module->codeHashes[i]) return false;
+    }
+    for(size_t i = 0; i < functions.size(); i++){
+        functions[i]->aot = module->functions[i];
+    }
+    return true;
+}
+
+int Aot::main(const AotModule* module){
+    // the translated code stands in for the JIT
+    JitConfig jitConfig;
+    jitConfig.enabled = false;
+    jitConfig.traces = false;
+    VirtualMachine vm(GcConfig(), module->flags & LEVC_REGISTERS, jitConfig);
+    switch(vm.interpret(std::string(module->source, module->sourceSize), module)){
+        case INTERPRET_COMPILE_ERROR: return 65;
+        case INTERPRET_RUNTIME_ERROR: return 70;
+        default: return 0;
+    }
+}
+
+// A number constant as a C++ literal that the compiler can fold, or empty
+// for anything else.
+std::string AotWriter::number(value_t val){
+    if(!IS_NUMBER(val) || !std::isfinite(AS_NUMBER(val))) return "";
+    char literal[64];
+    snprintf(literal, sizeof(literal), "NUMBER_VAL(%a)", AS_NUMBER(val));
+    return literal;
+}
+
+static std::string constant(uint32_t index, std::string literal){
+    if(!literal.empty()) return literal;
+    return "constants[" + std::to_string(index) + "]";
+}
+
+static std::string local(uint8_t slot){
+    return "slots[" + std::to_string((int)slot - 1) + "]";
+}
+
+static std::string label(size_t offset){
+    return "L" + std::to_string(offset);
+}
+
+std::string AotWriter::registerOperand(Chunk* chunk, uint8_t spec){
+    if(spec & REGISTER_CONSTANT){
+        uint8_t index = spec & ~REGISTER_CONSTANT;
+        return constant(index, number(chunk->getValue(index)));
+    }
+    if(spec == REGISTER_STACK) return "sp[-1]";
+    return local(spec);
+}
+
+// Only the left operand of a register instruction can be on the stack, it
+// is popped once the instruction can no longer hand itself to the
+// interpreter.
+void AotWriter::registerInstruction(Chunk* chunk, size_t offset){
+    const uint8_t* ip = chunk->getCode() + offset;
+    uint8_t op = ip[0];
+    std::string exit = "AOT_EXIT(" + std::to_string(offset) + ");";
+    if(op == OP_R_LESS_JUMP){
+        size_t target = offset + 5 + ((ip[3] << 8) | ip[4]);
+        out << "    {\n"
+            << "        value_t a = " << registerOperand(chunk, ip[1]) << ";\n"
+            << "        value_t b = " << registerOperand(chunk, ip[2]) << ";\n"
+            << "        if(!IS_NUMBER(a) || !IS_NUMBER(b)) " << exit << "\n";
+        if(ip[1] == REGISTER_STACK) out << "        sp--;\n";
+        out << "        if(!(AS_NUMBER(a) < AS_NUMBER(b))) goto " << label(target) << ";\n"
+            << "    }\n";
+        return;
+    }
+    std::string dst = ip[1] == 0 ? "*sp++" : local(ip[1]);
+    out << "    {\n"
+        << "        value_t a = " << registerOperand(chunk, ip[2]) << ";\n";
+    if(op == OP_R_MOVE){
+        if(ip[2] == REGISTER_STACK) out << "        sp--;\n";
+        out << "        " << dst << " = a;\n"
+            << "    }\n";
+        return;
+    }
+    out << "        value_t b = " << registerOperand(chunk, ip[3]) << ";\n"
+        << "        if(!IS_NUMBER(a) || !IS_NUMBER(b)) " << exit << "\n";
+    if(ip[2] == REGISTER_STACK) out << "        sp--;\n";
+    std::string result;
+    switch(op){
+        case OP_R_ADD: result = "NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b))"; break;
+        case OP_R_SUBTRACT: result = "NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b))"; break;
+        case OP_R_MULTIPLY: result = "NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b))"; break;
+        case OP_R_DIVIDE: result = "NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b))"; break;
+        case OP_R_LESS: result = "BOOL_VAL(AS_NUMBER(a) < AS_NUMBER(b))"; break;
+        default: result = "BOOL_VAL(AS_NUMBER(a) > AS_NUMBER(b))"; break;
+    }
+    out << "        " << dst << " = " << result << ";\n"
+        << "    }\n";
+}
+
+void AotWriter::instruction(Chunk* chunk, size_t offset){
+    const uint8_t* ip = chunk->getCode() + offset;
+    uint8_t op = ip[0];
+    std::string at = std::to_string(offset);
+    std::string numbers = "    AOT_NUMBERS(" + at + ");\n";
+    switch(op){
+        case OP_CONSTANT:
+            out << "    *sp++ = " << constant(ip[1], number(chunk->getValue(ip[1]))) << ";\n";
+            break;
+        case OP_CONSTANT_LONG:{
+            uint32_t index = (ip[1] << 16) | (ip[2] << 8) | ip[3];
+            out << "    *sp++ = " << constant(index, number(chunk->getValue(index))) << ";\n";
+            break;
+        }
+        case OP_NIL: out << "    *sp++ = NIL_VAL;\n"; break;
+        case OP_TRUE: out << "    *sp++ = BOOL_VAL(true);\n"; break;
+        case OP_FALSE: out << "    *sp++ = BOOL_VAL(false);\n"; break;
+        case OP_POP: out << "    sp--;\n"; break;
+        case OP_GET_LOCAL: out << "    *sp++ = " << local(ip[1]) << ";\n"; break;
+        case OP_SET_LOCAL: out << "    " << local(ip[1]) << " = sp[-1];\n"; break;
+        case OP_SET_LOCAL_POP: out << "    " << local(ip[1]) << " = *--sp;\n"; break;
+        case OP_GET_LOCAL_LOCAL:
+            out << "    *sp++ = " << local(ip[1]) << ";\n"
+                << "    *sp++ = " << local(ip[2]) << ";\n";
+            break;
+        case OP_ADD_LOCAL_CONSTANT:{
+            std::string literal = number(chunk->getValue(ip[2]));
+            if(literal.empty()){
+                out << "    AOT_CALL(add, " << at << ");\n";
+                break;
+            }
+            std::string a = local(ip[1]);
+            out << "    if(IS_NUMBER(" << a << ")) *sp++ = NUMBER_VAL(AS_NUMBER(" << a << ") + AS_NUMBER("
+                << literal << "));\n"
+                << "    else AOT_CALL(add, " << at << ");\n";
+            break;
+        }
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+            out << "    AOT_CALL(getGlobal, " << at << ");\n";
+            break;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+            out << "    AOT_CALL(setGlobal, " << at << ");\n";
+            break;
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+            out << "    AOT_CALL(defineGlobal, " << at << ");\n";
+            break;
+        case OP_GET_UPVALUE: out << "    AOT_CALL(getUpvalue, " << at << ");\n"; break;
+        case OP_SET_UPVALUE: out << "    AOT_CALL(setUpvalue, " << at << ");\n"; break;
+        case OP_GET_PROPERTY:
+        case OP_GET_THIS_PROPERTY:
+            out << "    AOT_CALL(getProperty, " << at << ");\n";
+            break;
+        case OP_SET_PROPERTY: out << "    AOT_CALL(setProperty, " << at << ");\n"; break;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            out << "    if(IS_NUMBER(sp[-1]) && IS_NUMBER(sp[-2])){\n"
+                << "        sp[-2] = BOOL_VAL(AS_NUMBER(sp[-2]) " << (op == OP_EQUAL ? "==" : "!=")
+                << " AS_NUMBER(sp[-1]));\n"
+                << "        sp--;\n"
+                << "    }else AOT_CALL(equal, " << at << ");\n";
+            break;
+        case OP_GREATER:
+            out << numbers << "    sp[-2] = BOOL_VAL(AS_NUMBER(sp[-2]) > AS_NUMBER(sp[-1]));\n    sp--;\n";
+            break;
+        case OP_LESS:
+        case OP_LESS_NUM:
+            out << numbers << "    sp[-2] = BOOL_VAL(AS_NUMBER(sp[-2]) < AS_NUMBER(sp[-1]));\n    sp--;\n";
+            break;
+        case OP_GREATER_EQUAL:
+            out << numbers << "    sp[-2] = BOOL_VAL(!(AS_NUMBER(sp[-2]) < AS_NUMBER(sp[-1])));\n    sp--;\n";
+            break;
+        case OP_LESS_EQUAL:
+            out << numbers << "    sp[-2] = BOOL_VAL(!(AS_NUMBER(sp[-2]) > AS_NUMBER(sp[-1])));\n    sp--;\n";
+            break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+            out << "    if(IS_NUMBER(sp[-1]) && IS_NUMBER(sp[-2])){\n"
+                << "        sp[-2] = NUMBER_VAL(AS_NUMBER(sp[-2]) + AS_NUMBER(sp[-1]));\n"
+                << "        sp--;\n"
+                << "    }else AOT_CALL(add, " << at << ");\n";
+            break;
+        case OP_SUBTRACT:
+            out << numbers << "    sp[-2] = NUMBER_VAL(AS_NUMBER(sp[-2]) - AS_NUMBER(sp[-1]));\n    sp--;\n";
+            break;
+        case OP_MULTIPLY:
+            out << numbers << "    sp[-2] = NUMBER_VAL(AS_NUMBER(sp[-2]) * AS_NUMBER(sp[-1]));\n    sp--;\n";
+            break;
+        case OP_DIVIDE:
+            out << numbers << "    sp[-2] = NUMBER_VAL(AS_NUMBER(sp[-2]) / AS_NUMBER(sp[-1]));\n    sp--;\n";
+            break;
+        case OP_NOT: out << "    sp[-1] = BOOL_VAL(AOT_FALSEY(sp[-1]));\n"; break;
+        case OP_NEGATE:
+            out << "    if(!IS_NUMBER(sp[-1])) AOT_EXIT(" << at << ");\n"
+                << "    sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1]));\n";
+            break;
+        case OP_PRINT: out << "    AOT_CALL(print, " << at << ");\n"; break;
+        case OP_CLOSE_UPVALUE: out << "    AOT_CALL(closeUpvalue, " << at << ");\n"; break;
+        case OP_JUMP:
+            out << "    goto " << label(offset + 3 + ((ip[1] << 8) | ip[2])) << ";\n";
+            break;
+        case OP_JUMP_IF_FALSE:
+            out << "    if(AOT_FALSEY(sp[-1])) goto " << label(offset + 3 + ((ip[1] << 8) | ip[2])) << ";\n";
+            break;
+        case OP_LESS_JUMP_IF_FALSE:
+            out << numbers << "    sp -= 2;\n"
+                << "    if(!(AS_NUMBER(sp[0]) < AS_NUMBER(sp[1]))) goto "
+                << label(offset + 3 + ((ip[1] << 8) | ip[2])) << ";\n";
+            break;
+        case OP_LOOP:
+            out << "    AOT_CALL(safepoint, " << at << ");\n"
+                << "    goto " << label(offset + 3 - ((ip[1] << 8) | ip[2])) << ";\n";
+            break;
+        case OP_R_ADD:
+        case OP_R_SUBTRACT:
+        case OP_R_MULTIPLY:
+        case OP_R_DIVIDE:
+        case OP_R_LESS:
+        case OP_R_GREATER:
+        case OP_R_MOVE:
+        case OP_R_LESS_JUMP:
+            registerInstruction(chunk, offset);
+            break;
+        default:
+            // calls, returns and the rest of the instructions
+            out << "    AOT_EXIT(" << at << ");\n";
+            break;
+    }
+}
+
+void AotWriter::writeFunction(size_t index, ObjFunction* function){
+    Chunk* chunk = function->chunk.get();
+    const uint8_t* code = chunk->getCode();
+    size_t size = chunk->getCodeSize();
+
+    // the interpreter comes back at the start, after a call returns and
+    // at the target of a backward jump
+    std::vector<size_t> resumes{0};
+    labels.assign(size + 1, false);
+    labels[0] = true;
+    for(size_t offset = 0; offset < size; offset += chunk->instructionLength(offset)){
+        const uint8_t* ip = code + offset;
+        size_t next = offset + chunk->instructionLength(offset);
+        switch(ip[0]){
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_LESS_JUMP_IF_FALSE:
+                labels[next + ((ip[1] << 8) | ip[2])] = true;
+                break;
+            case OP_R_LESS_JUMP:
+                labels[next + ((ip[3] << 8) | ip[4])] = true;
+                break;
+            case OP_LOOP:
+                labels[next - ((ip[1] << 8) | ip[2])] = true;
+                resumes.push_back(next - ((ip[1] << 8) | ip[2]));
+                break;
+            case OP_CALL:
+            case OP_INVOKE:
+            case OP_INVOKE_LONG:
+            case OP_SUPER_INVOKE:
+            case OP_SUPER_INVOKE_LONG:
+                labels[next] = true;
+                resumes.push_back(next);
+                break;
+        }
+    }
+
+    out << "// " << (function->name.empty() ? "script" : function->name) << "\n"
+        << "static value_t* function" << index << "(VirtualMachine* vm, CallFrame* frame, value_t* sp){\n"
+        << "    const uint8_t* code = frame->closure->function->chunk->getCode();\n"
+        << "    const value_t* constants = frame->closure->function->chunk->getValues();\n"
+        << "    value_t* slots = &*frame->slots;\n"
+        << "    (void)constants;\n"
+        << "    (void)slots;\n"
+        << "    switch(frame->ip - code){\n";
+    std::vector<bool> written(size + 1, false);
+    for(size_t offset : resumes){
+        if(written[offset]) continue;
+        written[offset] = true;
+        out << "        case " << offset << ": goto " << label(offset) << ";\n";
+    }
+    // anywhere else the interpreter carries on by itself
+    out << "        default: return sp;\n"
+        << "    }\n";
+    for(size_t offset = 0; offset < size; offset += chunk->instructionLength(offset)){
+        if(labels[offset]) out << label(offset) << ":\n";
+        out << "    // " << get_op_code(code[offset]) << "\n";
+        instruction(chunk, offset);
+    }
+    out << "    return sp;\n"
+        << "}\n\n";
+}
+
+bool AotWriter::write(std::string path, const std::string& source, uint32_t flags, ObjFunction* script){
+    std::vector<ObjFunction*> functions = Aot::functions(script);
+    out.str("");
+    out << "// Translated by levi --aot, see aot.hpp. Build against the headers and\n"
+        << "// the levi_runtime library of the levi that wrote it.\n";
+#ifdef NAN_BOXING
+    out << "#ifndef NAN_BOXING\n"
+        << "#define NAN_BOXING\n"
+        << "#endif\n";
+#endif
+    out << "#include \"aot.hpp\"\n\n";
+    for(size_t i = 0; i < functions.size(); i++) writeFunction(i, functions[i]);
+
+    out << "static const char source[] =\n    \"";
+    for(char c : source){
+        if(c == '\n'){
+            out << "\\n\"\n    \"";
+        }else if(c == '"' || c == '\\' || c == '?'){
+            out << '\\' << c;
+        }else if(c >= ' ' && c <= '~'){
+            out << c;
+        }else{
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\%03o", (unsigned)(uint8_t)c);
+            out << escape;
+        }
+    }
+    out << "\";\n\n";
+
+    out << "static const AotFunction functions[] = {\n";
+    for(size_t i = 0; i < functions.size(); i++) out << "    function" << i << ",\n";
+    out << "};\n\n"
+        << "static const uint64_t codeHashes[] = {\n";
+    for(ObjFunction* function : functions) out << "    " << hashCode(function) << "ull,\n";
+    out << "};\n\n"
+        << "static const AotModule module{source, sizeof(source) - 1, " << flags << ", "
+        << functions.size() << ", functions, codeHashes};\n\n"
+        << "int main(){\n"
+        << "    return Aot::main(&module);\n"
+        << "}\n";
+
+    std::ofstream file(path);
+    if(!file) return false;
+    file << out.str();
+    file.close();
+    return (bool)file;
+}
@@ -1,23 +1,114 @@
+#include <algorithm>
 #include "chunk.hpp"
+#include "object.hpp"
 
 
+void Chunk::writeLine(int line){
+    if(line_stack->empty() || line_stack->back().line != line){
+        line_stack->push_back(LineRun{(int)chunk_stack->size(), line});
+    }
+}
+
 void Chunk::writeChunk(uint8_t bytecode, int line){
+    writeLine(line);
     chunk_stack->push_back(bytecode);
-    line_stack->push_back(line);
+}
+
+void Chunk::truncate(int size){
+    chunk_stack->resize(size);
+    while(!line_stack->empty() && line_stack->back().offset >= size){
+        line_stack->pop_back();
+    }
+}
+
+void Chunk::replaceCode(chunk_array code, line_array lines){
+    *chunk_stack = std::move(code);
+    *line_stack = std::move(lines);
+}
+
+int Chunk::instructionLength(int offset){
+    const uint8_t* code = getCode();
+    switch(code[offset]){
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_GET_SUPER:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_GET_LOCAL_LOCAL:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_R_MOVE:
+            return 3;
+        case OP_GET_PROPERTY:
+        case OP_GET_THIS_PROPERTY:
+        case OP_R_ADD:
+        case OP_R_SUBTRACT:
+        case OP_R_MULTIPLY:
+        case OP_R_DIVIDE:
+        case OP_R_LESS:
+        case OP_R_GREATER:
+        case OP_SET_PROPERTY:
+        case OP_CONSTANT_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_CLASS_LONG:
+        case OP_METHOD_LONG:
+        case OP_GET_SUPER_LONG:
+            return 4;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_R_LESS_JUMP:
+            return 5;
+        case OP_GET_PROPERTY_LONG:
+        case OP_SET_PROPERTY_LONG:
+            return 6;
+        case OP_INVOKE_LONG:
+        case OP_SUPER_INVOKE_LONG:
+            return 7;
+        case OP_CLOSURE:{
+            ObjFunction* function = AS_FUNCTION(getValue(code[offset+1]));
+            return 2 + 2 * function->upvalueCount;
+        }
+        case OP_CLOSURE_LONG:{
+            int constant = (code[offset+1] << 16) | (code[offset+2] << 8) | code[offset+3];
+            ObjFunction* function = AS_FUNCTION(getValue(constant));
+            return 4 + 2 * function->upvalueCount;
+        }
+        default:
+            return 1;
+    }
 }
 
 chunk_array* Chunk::getChunk(){
     return chunk_stack.get();
 }
 
-uint8_t Chunk::addConstantToValue(value_t val){
+void Chunk::mapCode(const uint8_t* code, size_t size, line_array lines){
+    mappedCode = code;
+    mappedSize = size;
+    *line_stack = std::move(lines);
+}
+
+int Chunk::addConstantToValue(value_t val){
     return value.addConstant(val);
 }
 
-void Chunk::writeValue(value_t val, int line){
-    uint8_t constant_index = value.addConstant(val);
-    chunk_stack->push_back(constant_index);
-    line_stack->push_back(line);
+int Chunk::addCache(){
+    caches.emplace_back();
+    return caches.size() - 1;
 }
 
 value_t Chunk::getValue(int index){
@@ -29,5 +120,9 @@ int Chunk::getValueSize(){
 }
 
 int Chunk::getLine(int offset){
-    return (*line_stack)[offset];
+    // the last run starting at or before offset
+    auto run = std::upper_bound(line_stack->begin(), line_stack->end(), offset,
+        [](int offset, const LineRun& run){ return offset < run.offset; });
+    if(run == line_stack->begin()) return 0;
+    return (run - 1)->line;
 }
\ No newline at end of file
@@ -1,6 +1,9 @@
 #include <iostream>
 #include <functional>
+#include <cstring>
 #include "compiler.hpp"
+#include "optimizer.hpp"
+#include "verifier.hpp"
 #include "scanner.hpp"
 
 
@@ -66,6 +69,11 @@ Chunk* Compiler::currentChunk(){
 ObjFunction* Compiler::endCompiler(){
     emitReturn();
     ObjFunction* local_function = currentCompiler->compilerState.function;
+    if(!parser.hadError){
+        optimizeChunk(local_function->chunk.get(), registers);
+        local_function->stackSize = verifyFunction(local_function, globals->size());
+        if(local_function->stackSize < 0) error("Compiled code failed verification.");
+    }
     #ifdef DEBUG_PRINT_CODE
         if (!parser.hadError){
             disassembleChunk(local_function->name, local_function->chunk.get());
@@ -80,27 +88,27 @@ void Compiler::binary(){
     parsePrecedence((Precedence)(rule->precedence + 1));
     switch(operatorType){
         case TOKEN_BANG_EQUAL:{
-            emitByte(OP_EQUAL);
-            emitByte(OP_NOT);
+            emitOperator(OP_EQUAL);
+            emitOperator(OP_NOT);
             break;}
         case TOKEN_EQUAL_EQUAL:
-            emitByte(OP_EQUAL); break;
+            emitOperator(OP_EQUAL); break;
         case TOKEN_GREATER:
-            emitByte(OP_GREATER); break;
+            emitOperator(OP_GREATER); break;
         case TOKEN_GREATER_EQUAL:{
-            emitByte(OP_LESS);
-            emitByte(OP_NOT);
+            emitOperator(OP_LESS);
+            emitOperator(OP_NOT);
             break;}
         case TOKEN_LESS:
-            emitByte(OP_LESS); break;
+            emitOperator(OP_LESS); break;
         case TOKEN_LESS_EQUAL:{
-            emitByte(OP_GREATER);
-            emitByte(OP_NOT);
+            emitOperator(OP_GREATER);
+            emitOperator(OP_NOT);
             break;}
-        case TOKEN_PLUS:    emitByte(OP_ADD); break;
-        case TOKEN_MINUS:   emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR:    emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH:   emitByte(OP_DIVIDE); break;
+        case TOKEN_PLUS:    emitOperator(OP_ADD); break;
+        case TOKEN_MINUS:   emitOperator(OP_SUBTRACT); break;
+        case TOKEN_STAR:    emitOperator(OP_MULTIPLY); break;
+        case TOKEN_SLASH:   emitOperator(OP_DIVIDE); break;
         default: return; 
     }
 }
@@ -110,8 +118,11 @@ void Compiler::expression(){
 }
 
 Token Compiler::syntheticToken(std::string text){
+    // the token points into its text, so that has to outlive the compiler
+    static std::unordered_map<std::string, std::string> texts;
+    std::string& kept = texts.emplace(text, text).first->second;
     Token token;
-    token.start = text.begin();
+    token.start = kept.begin();
     token.length = text.size();
     return token;
 }
@@ -132,19 +143,19 @@ void Compiler::forStatement(){
     } else {
         expressionStatement();
     }
-    int loopStart = currentChunk()->getChunk()->size();
+    int loopStart = markLoopStart();
     int exitJump = -1;
     if(!match(TOKEN_SEMICOLON)){
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
-        exitJump = emitJump(OP_JUMP_IF_FALSE);
+        exitJump = emitConditionJump();
         emitByte(OP_POP);
     }
 
     if (!match(TOKEN_RIGHT_PAREN)) {
         int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->getChunk()->size();
+        int incrementStart = markLoopStart();
         expression();
         emitByte(OP_POP);
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
@@ -165,12 +176,12 @@ void Compiler::forStatement(){
 }
 
 void Compiler::whileStatement(){
-    int loopStart = currentChunk()->getChunk()->size();
+    int loopStart = markLoopStart();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
+    int exitJump = emitConditionJump();
     emitByte(OP_POP);
     statement();
     emitLoop(loopStart);
@@ -190,7 +201,7 @@ void Compiler::ifStatement(){
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
+    int thenJump = emitConditionJump();
     emitByte(OP_POP);
     statement();
     int elseJump = emitJump(OP_JUMP);
@@ -244,16 +255,17 @@ void Compiler::beginScope(){
 }
 
 void Compiler::endScope(){
-    currentCompiler->compilerState.scopeDepth--;
+    CompilerState* state = &currentCompiler->compilerState;
+    state->scopeDepth--;
 
-    while(compilerState.localCount > 0 && compilerState.locals[compilerState.localCount-1].depth >
-                compilerState.scopeDepth){
-            if (currentCompiler->compilerState.locals[currentCompiler->compilerState.localCount-1].isCaptured){
+    while(state->localCount > 0 && state->locals[state->localCount-1].depth >
+                state->scopeDepth){
+            if (state->locals[state->localCount-1].isCaptured){
                 emitByte(OP_CLOSE_UPVALUE);
             }else{
                 emitByte(OP_POP);
             }
-            compilerState.localCount--;
+            state->localCount--;
         }
 }
 
@@ -266,7 +278,7 @@ void Compiler::block(){
 
 void Compiler::method(){
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+    int constant = identifierConstant(&parser.previous);
     FunctionType type = TYPE_METHOD;
     if(parser.previous.length == 4 &&\
         std::string(parser.previous.start,
@@ -275,19 +287,21 @@ void Compiler::method(){
               type = TYPE_INITIALIZER;
         }
     function(type);
-    emitByte(OP_METHOD);
-    emitByte(constant);
+    emitIndexed(OP_METHOD, OP_METHOD_LONG, constant);
 }
 
 void Compiler::classDeclaration(){
     consume(TOKEN_IDENTIFIER, "Expect class name");
     Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
+    int nameConstant = identifierConstant(&parser.previous);
     declareVariable();
+    int global = 0;
+    if(currentCompiler->compilerState.scopeDepth == 0){
+        global = globalSlot(&className);
+    }
 
-    emitByte(OP_CLASS);
-    emitByte(nameConstant);
-    defineVariable(nameConstant);
+    emitIndexed(OP_CLASS, OP_CLASS_LONG, nameConstant);
+    defineVariable(global);
 
     ClassCompiler classCompiler;
     classCompiler.enclosing = currentClass;
@@ -317,11 +331,15 @@ void Compiler::classDeclaration(){
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
     emitByte(OP_POP);
 
+    if(classCompiler.hasSuperclass){
+        endScope();
+    }
+
     currentClass = currentClass->enclosing;
 }
 
 void Compiler::varDeclaration(){
-    uint8_t global = parseVariable("Expect variable name.");
+    int global = parseVariable("Expect variable name.");
     if(match(TOKEN_EQUAL)){
         expression();
     }else{
@@ -332,7 +350,7 @@ void Compiler::varDeclaration(){
 }
 
 void Compiler::funDeclaration(){
-    uint8_t global = parseVariable("Expect function name.");
+    int global = parseVariable("Expect function name.");
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
@@ -373,21 +391,37 @@ void Compiler::synchronize(){
     }
 }
 
-uint8_t Compiler::makeConstant(value_t val) {
+int Compiler::makeConstant(value_t val) {
+  CompilerState* state = &currentCompiler->compilerState;
+  uint64_t bits = 0;
+  if (IS_NUMBER(val)) {
+    double number = AS_NUMBER(val);
+    memcpy(&bits, &number, sizeof(bits));
+    auto known = state->numberConstants.find(bits);
+    if (known != state->numberConstants.end()) return known->second;
+  } else if (IS_STRING(val)) {
+    auto known = state->stringConstants.find(AS_STRING(val));
+    if (known != state->stringConstants.end()) return known->second;
+  }
+
   int constant = currentChunk()->addConstantToValue(val);
-  if (constant > UINT8_MAX) {
+  if (IS_NUMBER(val)) {
+    state->numberConstants[bits] = constant;
+  } else if (IS_STRING(val)) {
+    state->stringConstants[AS_STRING(val)] = constant;
+  }
+  gc->writeBarrier((Obj*)currentCompiler->compilerState.function, val);
+  if (constant > MAX_LONG_OPERAND) {
     error("Too many constants in one chunk.");
     return 0;
   }
-  return (uint8_t)constant;
+  return constant;
 }
 
 void Compiler::string(){
-    ObjString* objString = new ObjString;
-    Object::getObjString(
+    ObjString* objString = gc->copyString(
         std::string(parser.previous.start + 1,
-                        parser.previous.start + parser.previous.length-1),
-        objString
+                        parser.previous.start + parser.previous.length-1)
     );
     emitConstant(OBJ_VAL(objString));
 }
@@ -439,6 +473,8 @@ int Compiler::addUpvalue(Compiler* compiler, uint8_t index, bool isLocal){
 
 void Compiler::namedVariable(Token name, bool canAssign){
     uint8_t getOp, setOp;
+    // globals are the only ones that can need a long operand
+    uint8_t getLongOp = OP_GET_GLOBAL_LONG, setLongOp = OP_SET_GLOBAL_LONG;
     int arg = resolveLocal(&currentCompiler->compilerState, &name);
     if(arg != -1){
         getOp = OP_GET_LOCAL;
@@ -447,17 +483,15 @@ void Compiler::namedVariable(Token name, bool canAssign){
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     }else{
-        arg = identifierConstant(&name);
+        arg = globalSlot(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
     if(canAssign && match(TOKEN_EQUAL)){
         expression();
-        emitByte(setOp);
-        emitByte((uint8_t)arg);
+        emitIndexed(setOp, setLongOp, arg);
     }else{
-        emitByte(getOp);
-        emitByte((uint8_t)arg);
+        emitIndexed(getOp, getLongOp, arg);
     }
 }
 
@@ -476,15 +510,15 @@ void Compiler::number(){
 
 void Compiler::literal(){
     switch(parser.previous.type){
-        case TOKEN_FALSE: emitByte(OP_FALSE); break;
-        case TOKEN_NIL: emitByte(OP_NIL); break;
-        case TOKEN_TRUE: emitByte(OP_TRUE); break;
+        case TOKEN_FALSE: emitLiteral(BOOL_VAL(false)); break;
+        case TOKEN_NIL: emitLiteral(NIL_VAL); break;
+        case TOKEN_TRUE: emitLiteral(BOOL_VAL(true)); break;
         default: return;
     }
 }
 
 void Compiler::function(FunctionType type){
-    Compiler compiler(source);
+    Compiler compiler(source, gc, globals, registers);
     Compiler* temp = currentCompiler; // move current one
     Compiler** temp_ptr = &currentCompiler;
     Compiler* new_ptr = &compiler;
@@ -505,7 +539,7 @@ void Compiler::function(FunctionType type){
             if(currentCompiler->compilerState.function->arity > 255){
                 errorAtCurrent("Can't have more than parameter name.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
+            int constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
         } while(match(TOKEN_COMMA));
     }
@@ -515,8 +549,8 @@ void Compiler::function(FunctionType type){
 
     ObjFunction* function = endCompiler();
     currentCompiler = currentCompiler->encloseCompiler; // regain current one
-    emitByte(OP_CLOSURE);
-    emitByte(makeConstant(OBJ_VAL(function)));
+    emitIndexed(OP_CLOSURE, OP_CLOSURE_LONG, makeConstant(OBJ_VAL(function)));
+    gc->popRoot();
 
     for (int i = 0; i < function->upvalueCount; i++){
         emitByte(compiler.compilerState.upvalues[i].isLocal ? 1 : 0);
@@ -532,20 +566,20 @@ void Compiler::call(bool canAssign){
 
 void Compiler::dot(bool canAssign){
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     if(canAssign && match(TOKEN_EQUAL)){
         expression();
-        emitByte(OP_SET_PROPERTY);
-        emitByte(name);
+        emitIndexed(OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name);
+        emitCache();
     }else if(match(TOKEN_LEFT_PAREN)){
         uint8_t argCount = argumentList();
-        emitByte(OP_INVOKE);
-        emitByte(name);
+        emitIndexed(OP_INVOKE, OP_INVOKE_LONG, name);
         emitByte(argCount);
+        emitCache();
     }else{
-        emitByte(OP_GET_PROPERTY);
-        emitByte(name);
+        emitIndexed(OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name);
+        emitCache();
     }
 }
 
@@ -571,6 +605,7 @@ void Compiler::patchJump(int offset){
     }
     (*currentChunk()->getChunk())[offset] = (jump >> 8) & 0xff;
     (*currentChunk()->getChunk())[offset+1] = jump & 0xff;
+    currentCompiler->compilerState.jumpTarget = currentChunk()->getChunk()->size();
 }
 
 int Compiler::emitJump(uint8_t instruction){
@@ -581,14 +616,157 @@ int Compiler::emitJump(uint8_t instruction){
 }
 
 void Compiler::emitConstant(value_t input_val){
-    currentChunk()->writeChunk(OP_CONSTANT, parser.previous.line);
-    currentChunk()->writeValue(input_val, parser.previous.line);
+    emitLiteral(input_val);
+}
+
+// Jumps over the body of an if, while or for when the condition on top of
+// the stack is false. A condition ending in '!!' has the same truthiness
+// without it, and both paths pop it right away, so the two OP_NOTs go.
+int Compiler::emitConditionJump(){
+    CompilerState* state = &currentCompiler->compilerState;
+    int size = currentChunk()->getChunk()->size();
+    int count = state->nots.size();
+    if(count >= 2 && state->nots[count-1] == size-1 && state->nots[count-2] == size-2
+        && size-2 >= state->jumpTarget){
+        rewind(size-2);
+    }
+    return emitJump(OP_JUMP_IF_FALSE);
+}
+
+// Loops jump back to the returned offset, so code before it must not be
+// folded together with code after it.
+int Compiler::markLoopStart(){
+    int offset = currentChunk()->getChunk()->size();
+    currentCompiler->compilerState.jumpTarget = offset;
+    return offset;
+}
+
+// Removes the instructions emitted from offset on.
+void Compiler::rewind(int offset){
+    CompilerState* state = &currentCompiler->compilerState;
+    currentChunk()->truncate(offset);
+    while(!state->literals.empty() && state->literals.back().end > offset){
+        state->literals.pop_back();
+    }
+    while(!state->nots.empty() && state->nots.back() >= offset){
+        state->nots.pop_back();
+    }
+}
+
+// Emits an instruction pushing val and remembers it, so that an operator
+// applied to it can be evaluated here instead of at run time.
+void Compiler::emitLiteral(value_t val){
+    CompilerState* state = &currentCompiler->compilerState;
+    int start = currentChunk()->getChunk()->size();
+    if(IS_NIL(val)){
+        emitByte(OP_NIL);
+    }else if(IS_BOOL(val)){
+        emitByte(AS_BOOL(val) ? OP_TRUE : OP_FALSE);
+    }else{
+        emitIndexed(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(val));
+    }
+    if(!state->literals.empty() && state->literals.back().end != start){
+        state->literals.clear();
+    }
+    state->literals.push_back(EmittedLiteral{start, (int)currentChunk()->getChunk()->size(), val});
+}
+
+void Compiler::emitOperator(uint8_t op){
+    bool folded = (op == OP_NOT || op == OP_NEGATE) ? foldUnary(op) : foldBinary(op);
+    if(folded) return;
+
+    CompilerState* state = &currentCompiler->compilerState;
+    int start = currentChunk()->getChunk()->size();
+    emitByte(op);
+    if(op == OP_NOT){
+        if(!state->nots.empty() && state->nots.back() != start-1) state->nots.clear();
+        state->nots.push_back(start);
+    }
+}
+
+// The operand of a unary operator is a literal when the last instruction
+// emitted pushes one and no jump lands after its start.
+bool Compiler::foldUnary(uint8_t op){
+    CompilerState* state = &currentCompiler->compilerState;
+    int size = currentChunk()->getChunk()->size();
+    if(state->literals.empty()) return false;
+    EmittedLiteral operand = state->literals.back();
+    if(operand.end != size || operand.start < state->jumpTarget) return false;
+
+    value_t result;
+    if(op == OP_NOT){
+        result = BOOL_VAL(IS_NIL(operand.value) || (IS_BOOL(operand.value) && !AS_BOOL(operand.value)));
+    }else if(IS_NUMBER(operand.value)){
+        result = NUMBER_VAL(-AS_NUMBER(operand.value));
+    }else{
+        // left for the VM to report
+        return false;
+    }
+    rewind(operand.start);
+    emitLiteral(result);
+    return true;
+}
+
+bool Compiler::foldBinary(uint8_t op){
+    CompilerState* state = &currentCompiler->compilerState;
+    int size = currentChunk()->getChunk()->size();
+    int count = state->literals.size();
+    if(count < 2) return false;
+    EmittedLiteral a = state->literals[count-2];
+    EmittedLiteral b = state->literals[count-1];
+    if(b.end != size || a.end != b.start || a.start < state->jumpTarget) return false;
+
+    value_t result;
+    if(op == OP_EQUAL){
+        result = BOOL_VAL(Value::valuesEqual(a.value, b.value));
+    }else if(IS_NUMBER(a.value) && IS_NUMBER(b.value)){
+        double x = AS_NUMBER(a.value);
+        double y = AS_NUMBER(b.value);
+        switch(op){
+            case OP_GREATER:  result = BOOL_VAL(x > y); break;
+            case OP_LESS:     result = BOOL_VAL(x < y); break;
+            case OP_ADD:      result = NUMBER_VAL(x + y); break;
+            case OP_SUBTRACT: result = NUMBER_VAL(x - y); break;
+            case OP_MULTIPLY: result = NUMBER_VAL(x * y); break;
+            case OP_DIVIDE:   result = NUMBER_VAL(x / y); break;
+            default: return false;
+        }
+    }else if(op == OP_ADD && IS_STRING(a.value) && IS_STRING(b.value)){
+        // both operands stay reachable from the constant pool
+        result = OBJ_VAL(gc->copyString(AS_STRING(a.value)->strs + AS_STRING(b.value)->strs));
+    }else{
+        return false;
+    }
+    rewind(a.start);
+    emitLiteral(result);
+    return true;
+}
+
+// Emits op with a one byte operand when index fits, otherwise its long
+// variant with a 24-bit big-endian operand.
+void Compiler::emitIndexed(uint8_t shortOp, uint8_t longOp, int index){
+    if(index <= UINT8_MAX){
+        emitByte(shortOp);
+        emitByte(index);
+        return;
+    }
+    emitByte(longOp);
+    emitByte((index >> 16) & 0xff);
+    emitByte((index >> 8) & 0xff);
+    emitByte(index & 0xff);
 }
 
 void Compiler::emitByte(uint8_t op_code){
     currentChunk()->writeChunk(op_code, parser.previous.line);
 }
 
+void Compiler::emitCache(){
+    int cache = currentChunk()->addCache();
+    if(cache > UINT16_MAX) error("Too many property accesses in one function.");
+    emitByte((cache >> 8) & 0xff);
+    emitByte(cache & 0xff);
+}
+
 void Compiler::emitLoop(int loopStart){
     emitByte(OP_LOOP);
 
@@ -616,25 +794,25 @@ void Compiler::grouping(){
 
 void Compiler::unary(){
     TokenType operatorType = parser.previous.type;
-    expression();
+    parsePrecedence(PREC_UNARY);
     switch(operatorType){
         case TOKEN_BANG:{
-            emitByte(OP_NOT);
+            emitOperator(OP_NOT);
             break;
         }
         case TOKEN_MINUS: {
-            emitByte(OP_NEGATE);
+            emitOperator(OP_NEGATE);
             break;}
         default:
             return;
     }
 }
 
-uint8_t Compiler::parseVariable(std::string errorMessage){
+int Compiler::parseVariable(std::string errorMessage){
     consume(TOKEN_IDENTIFIER, errorMessage);
     declareVariable();
     if(currentCompiler->compilerState.scopeDepth > 0) return 0;
-    return identifierConstant(&parser.previous);
+    return globalSlot(&parser.previous);
 }
 
 void Compiler::markInitialized(){
@@ -676,13 +854,12 @@ void Compiler::addLocal(Token name){
     local->isCaptured = false;
 }
 
-void Compiler::defineVariable(uint8_t global){
+void Compiler::defineVariable(int global){
     if(currentCompiler->compilerState.scopeDepth > 0){
         markInitialized();
         return;
     }
-    emitByte(OP_DEFINE_GLOBAL);
-    emitByte(global);
+    emitIndexed(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
 
 void Compiler::and_(bool canAssign){
@@ -722,31 +899,41 @@ void Compiler::super_(bool canAssign){
 
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     namedVariable(syntheticToken("this"), false);
     if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
         namedVariable(syntheticToken("super"), false);
-        emitByte(OP_SUPER_INVOKE);
-        emitByte(name);
+        emitIndexed(OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name);
         emitByte(argCount);
+        emitCache();
     } else {
         namedVariable(syntheticToken("super"), false);
-        emitByte(OP_GET_SUPER);
-        emitByte(name);
+        emitIndexed(OP_GET_SUPER, OP_GET_SUPER_LONG, name);
     }
 }
 
-uint8_t Compiler::identifierConstant(Token* name){
-    ObjString* objString = new ObjString;
-    Object::getObjString(
-        std::string(name->start, name->start + name->length),
-        objString
+int Compiler::identifierConstant(Token* name){
+    ObjString* objString = gc->copyString(
+        std::string(name->start, name->start + name->length)
     );
     return makeConstant(OBJ_VAL(objString));
 }
 
+int Compiler::globalSlot(Token* name){
+    ObjString* objString = gc->copyString(
+        std::string(name->start, name->start + name->length)
+    );
+    int slot = globals->resolve(objString);
+    gc->writeBarrier(globals, slot);
+    if(slot > MAX_LONG_OPERAND){
+        error("Too many global variables.");
+        return 0;
+    }
+    return slot;
+}
+
 void Compiler::parsePrecedence(Precedence precedence){
     advance();
     auto prefixRule = getRule(parser.previous.type)->prefix;
@@ -791,6 +978,7 @@ ObjFunction* Compiler::compile(std::string source){
         declaration();
     }
     ObjFunction* function = endCompiler();
+    gc->popRoot();
     if(parser.hadError) return NULL;
     return function;
 }
@@ -0,0 +1,426 @@
+#include "jit.hpp"
+#include "x64.hpp"
+#include "runtime.hpp"
+#include "vm.hpp"
+
+#ifdef JIT_X64
+#include <sys/mman.h>
+#endif
+
+JitCode::~JitCode(){
+#ifdef JIT_X64
+    if(code != NULL) munmap(code, size);
+#endif
+}
+
+// rdi vm, rsi the frame's slots, rdx the stack top, rcx the address to
+// start at and r8 the frame
+using JitEntry = value_t* (*)(VirtualMachine*, value_t*, value_t*, const uint8_t*, CallFrame*);
+
+value_t* Jit::execute(VirtualMachine* vm, CallFrame* frame, value_t* sp){
+    ObjFunction* function = frame->closure->function;
+    JitCode* jit = function->jit.get();
+    size_t offset = frame->ip - function->chunk->getCode();
+    JitEntry entry = reinterpret_cast<JitEntry>(jit->code);
+    return entry(vm, &*frame->slots, sp, jit->code + jit->entries[offset], frame);
+}
+
+#ifdef JIT_X64
+
+// held by compiled code for the whole time it runs
+#define STACK RBX       // next free stack slot
+#define SLOTS R12       // local n is at SLOTS + (n - 1) * VALUE_SIZE
+#define VM R13
+#define FRAME R14
+#define CONSTANTS R15
+
+using JitHelper = value_t* (*)(VirtualMachine*, value_t*, const uint8_t*);
+
+// Emits the templates of one function.
+class JitAssembler : public X64Assembler{
+    public:
+        JitAssembler(ObjFunction* function, const GcPhase* phase)
+        : function(function), phase(phase){}
+        bool assemble(JitCode* jit);
+    private:
+        int labelAt(size_t offset);
+        int exitAt(size_t offset);
+
+        void callHelper(JitHelper helper, size_t offset);
+
+        Location local(int slot){ return Location{SLOTS, (slot - 1) * VALUE_SIZE}; }
+        Location constant(uint32_t index){ return Location{CONSTANTS, (int32_t)index * VALUE_SIZE}; }
+        Location peek(int distance){ return Location{STACK, -(distance + 1) * VALUE_SIZE}; }
+        Location top(){ return Location{STACK, 0}; }
+        Location registerOperand(uint8_t spec);
+
+        bool instruction(size_t offset);
+        void arithmetic(size_t offset, uint8_t sse, bool strings);
+        void comparison(size_t offset, uint8_t op);
+        void registerInstruction(size_t offset, uint8_t op);
+
+        ObjFunction* function;
+        const uint8_t* code{NULL};
+        const GcPhase* phase;
+        // label of each bytecode offset used as a jump target
+        std::vector<int> targets;
+        // labels of the stubs that hand an instruction to the interpreter
+        std::vector<int> exits;
+        int epilogue{-1};
+};
+
+int JitAssembler::labelAt(size_t offset){
+    if(targets[offset] < 0) targets[offset] = newLabel();
+    return targets[offset];
+}
+
+int JitAssembler::exitAt(size_t offset){
+    if(exits[offset] < 0) exits[offset] = newLabel();
+    return exits[offset];
+}
+
+// A NULL result hands the instruction to the interpreter.
+void JitAssembler::callHelper(JitHelper helper, size_t offset){
+    move(RDI, VM);
+    move(RSI, STACK);
+    moveImmediate(RDX, (uint64_t)(code + offset));
+    moveImmediate(RAX, (uint64_t)helper);
+    callRegister(RAX);
+    alu(0x85, RAX, RAX);
+    jumpIf(CC_E, exitAt(offset));
+    move(STACK, RAX);
+}
+
+Location JitAssembler::registerOperand(uint8_t spec){
+    if(spec & REGISTER_CONSTANT) return constant(spec & ~REGISTER_CONSTANT);
+    if(spec == REGISTER_STACK) return peek(0);
+    return local(spec);
+}
+
+// Numbers inline. strings calls Runtime::add for two strings, anything else
+// goes to the interpreter, which raises the error.
+void JitAssembler::arithmetic(size_t offset, uint8_t op, bool strings){
+    int slow = strings ? newLabel() : exitAt(offset);
+    int done = newLabel();
+    checkNumber(peek(1), slow);
+    checkNumber(peek(0), slow);
+    loadNumber(peek(1));
+    sse(0xf2, op, 0, STACK, peek(0).disp + PAYLOAD);
+    storeNumber(peek(1));
+    addImmediate(STACK, -VALUE_SIZE);
+    if(strings){
+        jump(done);
+        bind(slow);
+        callHelper(Runtime::add, offset);
+    }
+    bind(done);
+}
+
+// The VM's >= and <= are !(a < b) and !(a > b), which unlike the SSE
+// comparisons are true when either operand is NaN.
+void JitAssembler::comparison(size_t offset, uint8_t op){
+    checkNumber(peek(1), exitAt(offset));
+    checkNumber(peek(0), exitAt(offset));
+    bool less = op == OP_LESS || op == OP_LESS_NUM || op == OP_GREATER_EQUAL;
+    // b > a for a < b, so that unordered operands compare false
+    Location left = less ? peek(0) : peek(1);
+    Location right = less ? peek(1) : peek(0);
+    loadNumber(left);
+    sse(0x66, 0x2e, 0, right.base, right.disp + PAYLOAD);
+    setAl(op == OP_GREATER_EQUAL || op == OP_LESS_EQUAL ? CC_BE : CC_A);
+    storeBool(peek(1));
+    addImmediate(STACK, -VALUE_SIZE);
+}
+
+void JitAssembler::registerInstruction(size_t offset, uint8_t op){
+    const uint8_t* ip = code + offset;
+    bool jumps = op == OP_R_LESS_JUMP;
+    uint8_t dst = jumps ? 0 : ip[1];
+    const uint8_t* sources = jumps ? ip + 1 : ip + 2;
+    int count = op == OP_R_MOVE ? 1 : 2;
+
+    Location a = registerOperand(sources[0]);
+    Location b = count == 2 ? registerOperand(sources[1]) : a;
+    if(op != OP_R_MOVE){
+        checkNumber(a, exitAt(offset));
+        checkNumber(b, exitAt(offset));
+    }
+    // the stack operand is always the left one
+    if(sources[0] == REGISTER_STACK){
+        addImmediate(STACK, -VALUE_SIZE);
+        a = top();
+    }
+    Location result = dst == 0 ? top() : local(dst);
+    switch(op){
+        case OP_R_MOVE:
+            copyValue(result, a);
+            return;
+        case OP_R_LESS_JUMP:{
+            size_t next = offset + 5;
+            loadNumber(b);
+            sse(0x66, 0x2e, 0, a.base, a.disp + PAYLOAD);
+            jumpIf(CC_BE, labelAt(next + ((ip[3] << 8) | ip[4])));
+            return;
+        }
+        case OP_R_LESS:
+        case OP_R_GREATER:
+            loadNumber(op == OP_R_LESS ? b : a);
+            sse(0x66, 0x2e, 0, (op == OP_R_LESS ? a : b).base, (op == OP_R_LESS ? a : b).disp + PAYLOAD);
+            setAl(CC_A);
+            storeBool(result);
+            break;
+        default:{
+            uint8_t sseOp = op == OP_R_ADD ? SSE_ADD : op == OP_R_SUBTRACT ? SSE_SUB
+                : op == OP_R_MULTIPLY ? SSE_MUL : SSE_DIV;
+            loadNumber(a);
+            sse(0xf2, sseOp, 0, b.base, b.disp + PAYLOAD);
+            storeNumber(result);
+            break;
+        }
+    }
+    if(dst == 0) addImmediate(STACK, VALUE_SIZE);
+}
+
+// Emits the template of the instruction at offset. Returns false for code
+// the assembler cannot follow.
+bool JitAssembler::instruction(size_t offset){
+    const uint8_t* ip = code + offset;
+    uint8_t op = *ip;
+    switch(op){
+        case OP_CONSTANT:
+            copyValue(top(), constant(ip[1]));
+            addImmediate(STACK, VALUE_SIZE);
+            break;
+        case OP_CONSTANT_LONG:
+            copyValue(top(), constant((ip[1] << 16) | (ip[2] << 8) | ip[3]));
+            addImmediate(STACK, VALUE_SIZE);
+            break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            storeValue(top(), op == OP_NIL ? NIL_VAL : BOOL_VAL(op == OP_TRUE));
+            addImmediate(STACK, VALUE_SIZE);
+            break;
+        case OP_POP:
+            addImmediate(STACK, -VALUE_SIZE);
+            break;
+        case OP_GET_LOCAL:
+            copyValue(top(), local(ip[1]));
+            addImmediate(STACK, VALUE_SIZE);
+            break;
+        case OP_SET_LOCAL:
+            copyValue(local(ip[1]), peek(0));
+            break;
+        case OP_SET_LOCAL_POP:
+            copyValue(local(ip[1]), peek(0));
+            addImmediate(STACK, -VALUE_SIZE);
+            break;
+        case OP_GET_LOCAL_LOCAL:
+            copyValue(top(), local(ip[1]));
+            copyValue(Location{STACK, VALUE_SIZE}, local(ip[2]));
+            addImmediate(STACK, 2 * VALUE_SIZE);
+            break;
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+            callHelper(Runtime::getGlobal, offset);
+            break;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+            callHelper(Runtime::setGlobal, offset);
+            break;
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+            callHelper(Runtime::defineGlobal, offset);
+            break;
+        case OP_GET_UPVALUE:
+            callHelper(Runtime::getUpvalue, offset);
+            break;
+        case OP_SET_UPVALUE:
+            callHelper(Runtime::setUpvalue, offset);
+            break;
+        case OP_GET_PROPERTY:
+        case OP_GET_THIS_PROPERTY:
+            callHelper(Runtime::getProperty, offset);
+            break;
+        case OP_SET_PROPERTY:
+            callHelper(Runtime::setProperty, offset);
+            break;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            callHelper(Runtime::equal, offset);
+            break;
+        case OP_LESS:
+        case OP_LESS_NUM:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+            comparison(offset, op);
+            break;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+            arithmetic(offset, SSE_ADD, true);
+            break;
+        case OP_SUBTRACT: arithmetic(offset, SSE_SUB, false); break;
+        case OP_MULTIPLY: arithmetic(offset, SSE_MUL, false); break;
+        case OP_DIVIDE: arithmetic(offset, SSE_DIV, false); break;
+        case OP_ADD_LOCAL_CONSTANT:{
+            int slow = newLabel();
+            int done = newLabel();
+            checkNumber(local(ip[1]), slow);
+            if(!IS_NUMBER(function->chunk->getValue(ip[2]))) jump(slow);
+            loadNumber(local(ip[1]));
+            sse(0xf2, SSE_ADD, 0, CONSTANTS, constant(ip[2]).disp + PAYLOAD);
+            storeNumber(top());
+            addImmediate(STACK, VALUE_SIZE);
+            jump(done);
+            bind(slow);
+            callHelper(Runtime::add, offset);
+            bind(done);
+            break;
+        }
+        case OP_NOT:{
+            int falsey = newLabel();
+            int done = newLabel();
+            branchIfFalsey(peek(0), falsey);
+            storeValue(peek(0), BOOL_VAL(false));
+            jump(done);
+            bind(falsey);
+            storeValue(peek(0), BOOL_VAL(true));
+            bind(done);
+            break;
+        }
+        case OP_NEGATE:
+            checkNumber(peek(0), exitAt(offset));
+            load(RAX, STACK, peek(0).disp + PAYLOAD);
+            moveImmediate(RCX, 0x8000000000000000ull);
+            alu(0x31, RAX, RCX);
+            store(STACK, peek(0).disp + PAYLOAD, RAX);
+            break;
+        case OP_PRINT:
+            callHelper(Runtime::print, offset);
+            break;
+        case OP_CLOSE_UPVALUE:
+            callHelper(Runtime::closeUpvalue, offset);
+            break;
+        case OP_JUMP:
+            jump(labelAt(offset + 3 + ((ip[1] << 8) | ip[2])));
+            break;
+        case OP_JUMP_IF_FALSE:
+            branchIfFalsey(peek(0), labelAt(offset + 3 + ((ip[1] << 8) | ip[2])));
+            break;
+        case OP_LESS_JUMP_IF_FALSE:
+            checkNumber(peek(1), exitAt(offset));
+            checkNumber(peek(0), exitAt(offset));
+            addImmediate(STACK, -2 * VALUE_SIZE);
+            loadNumber(Location{STACK, VALUE_SIZE});
+            sse(0x66, 0x2e, 0, STACK, PAYLOAD);
+            jumpIf(CC_BE, labelAt(offset + 3 + ((ip[1] << 8) | ip[2])));
+            break;
+        case OP_LOOP:{
+            // the collector only needs a call while a cycle is in progress
+            int target = labelAt(offset + 3 - ((ip[1] << 8) | ip[2]));
+            moveImmediate(RAX, (uint64_t)phase);
+            compareDword(RAX, 0, GC_IDLE);
+            jumpIf(CC_E, target);
+            callHelper(Runtime::safepoint, offset);
+            jump(target);
+            break;
+        }
+        case OP_R_ADD:
+        case OP_R_SUBTRACT:
+        case OP_R_MULTIPLY:
+        case OP_R_DIVIDE:
+        case OP_R_LESS:
+        case OP_R_GREATER:
+        case OP_R_MOVE:
+        case OP_R_LESS_JUMP:{
+            const uint8_t* sources = op == OP_R_LESS_JUMP ? ip + 1 : ip + 2;
+            if(op != OP_R_MOVE && sources[1] == REGISTER_STACK) return false;
+            registerInstruction(offset, op);
+            break;
+        }
+        default:
+            // calls, returns and the rest of the instructions
+            jump(exitAt(offset));
+            break;
+    }
+    return true;
+}
+
+bool JitAssembler::assemble(JitCode* jit){
+    Chunk* chunk = function->chunk.get();
+    code = chunk->getCode();
+    size_t size = chunk->getCodeSize();
+    // calls and returns always go through the interpreter, so code without
+    // a loop would spend more entering the compiled code than it saves
+    bool loops = false;
+    for(size_t offset = 0; offset < size; offset += chunk->instructionLength(offset)){
+        if(code[offset] == OP_LOOP) loops = true;
+    }
+    if(!loops) return false;
+
+    targets.assign(size + 1, -1);
+    exits.assign(size, -1);
+    jit->entries.assign(size, 0);
+    epilogue = newLabel();
+
+    push(RBP);
+    push(RBX);
+    push(R12);
+    push(R13);
+    push(R14);
+    push(R15);
+    addImmediate(RSP, -8);      // keeps calls 16-byte aligned
+    move(VM, RDI);
+    move(SLOTS, RSI);
+    move(STACK, RDX);
+    move(FRAME, R8);
+    moveImmediate(CONSTANTS, (uint64_t)chunk->getValues());
+    jumpRegister(RCX);
+
+    for(size_t offset = 0; offset < size; offset += chunk->instructionLength(offset)){
+        if(targets[offset] < 0) targets[offset] = newLabel();
+        bind(targets[offset]);
+        jit->entries[offset] = out.size();
+        if(!instruction(offset)) return false;
+    }
+    // a jump past the last instruction or into the middle of one
+    for(size_t offset = 0; offset <= size; offset++){
+        if(targets[offset] >= 0 && !bound(targets[offset])) return false;
+    }
+
+    for(size_t offset = 0; offset < size; offset++){
+        if(exits[offset] < 0) continue;
+        bind(exits[offset]);
+        moveImmediate(RAX, (uint64_t)(code + offset));
+        store(FRAME, offsetof(CallFrame, ip), RAX);
+        jump(epilogue);
+    }
+    bind(epilogue);
+    move(RAX, STACK);
+    addImmediate(RSP, 8);
+    pop(R15);
+    pop(R14);
+    pop(R13);
+    pop(R12);
+    pop(RBX);
+    pop(RBP);
+    ret();
+
+    return install(jit);
+}
+
+#endif
+
+bool Jit::compile(VirtualMachine* vm, ObjFunction* function){
+#ifdef JIT_X64
+    auto jit = std::make_unique<JitCode>();
+    JitAssembler assembler(function, &vm->gc.phase);
+    if(!assembler.assemble(jit.get())) return false;
+    function->jit = std::move(jit);
+    return true;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,290 @@
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdio>
+#include "levc.hpp"
+#include "verifier.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LEVC_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+bool LevcImage::open(std::string path){
+#ifdef LEVC_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    struct stat info;
+    if(fstat(fd, &info) != 0 || info.st_size == 0){
+        close(fd);
+        return false;
+    }
+    void* address = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(address == MAP_FAILED) return false;
+    bytes = (const uint8_t*)address;
+    length = info.st_size;
+    mapped = true;
+    return true;
+#else
+    std::ifstream file(path, std::ios::binary);
+    if(!file) return false;
+    std::stringstream contents;
+    contents << file.rdbuf();
+    buffer = contents.str();
+    bytes = (const uint8_t*)buffer.data();
+    length = buffer.size();
+    return true;
+#endif
+}
+
+LevcImage::~LevcImage(){
+#ifdef LEVC_MMAP
+    if(mapped) munmap((void*)bytes, length);
+#endif
+}
+
+uint64_t LevcWriter::hashSource(const std::string& source){
+    uint64_t hash = 14695981039346656037ull;
+    for(char c : source){
+        hash ^= (uint8_t)c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+void LevcWriter::writeU32(uint32_t value){
+    for(int i = 0; i < 4; i++) writeByte((value >> (8 * i)) & 0xff);
+}
+
+void LevcWriter::writeU64(uint64_t value){
+    for(int i = 0; i < 8; i++) writeByte((value >> (8 * i)) & 0xff);
+}
+
+void LevcWriter::writeString(const std::string& strs){
+    writeU32(strs.size());
+    out += strs;
+}
+
+void LevcWriter::writeFunction(ObjFunction* function){
+    Chunk* chunk = function->chunk.get();
+    writeString(function->name);
+    writeU32(function->arity);
+    writeU32(function->upvalueCount);
+
+    writeU32(code.size());
+    writeU32(chunk->getCodeSize());
+    code.append((const char*)chunk->getCode(), chunk->getCodeSize());
+    const line_array& lines = chunk->getLines();
+    writeU32(lines.size());
+    for(const LineRun& run : lines){
+        writeU32(run.offset);
+        writeU32(run.line);
+    }
+    writeU32(chunk->getCacheSize());
+
+    writeU32(chunk->getValueSize());
+    for(int i = 0; i < chunk->getValueSize(); i++){
+        value_t val = chunk->getValue(i);
+        if(IS_NIL(val)){
+            writeByte(LEVC_NIL);
+        }else if(IS_BOOL(val)){
+            writeByte(AS_BOOL(val) ? LEVC_TRUE : LEVC_FALSE);
+        }else if(IS_NUMBER(val)){
+            double number = AS_NUMBER(val);
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(bits));
+            writeByte(LEVC_NUMBER);
+            writeU64(bits);
+        }else if(IS_STRING(val)){
+            writeByte(LEVC_STRING);
+            writeString(AS_STRING(val)->strs);
+        }else{
+            writeByte(LEVC_FUNCTION);
+            writeFunction(AS_FUNCTION(val));
+        }
+    }
+}
+
+bool LevcWriter::write(std::string path, uint64_t sourceHash, uint32_t flags, ObjFunction* function){
+    out.clear();
+    code.clear();
+    out += LEVC_MAGIC;
+    writeU32(LEVC_VERSION);
+    writeU64(sourceHash);
+    writeU32(flags);
+    size_t codeOffsetAt = out.size();
+    writeU32(0);
+    writeU32(globals->size());
+    for(ObjString* name : globals->names){
+        writeString(name->strs);
+    }
+    writeFunction(function);
+
+    while(out.size() % LEVC_CODE_ALIGN != 0) writeByte(0);
+    uint32_t codeOffset = out.size();
+    for(int i = 0; i < 4; i++) out[codeOffsetAt + i] = (char)((codeOffset >> (8 * i)) & 0xff);
+    out += code;
+
+    // write then rename, so that a concurrent run never sees half a file
+    std::string temporary = path + ".tmp";
+    std::ofstream file(temporary, std::ios::binary);
+    if(!file) return false;
+    file.write(out.data(), out.size());
+    file.close();
+    if(!file){
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return std::rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+uint8_t LevcReader::readByte(){
+    if(pos >= size){
+        failed = true;
+        return 0;
+    }
+    return in[pos++];
+}
+
+uint32_t LevcReader::readU32(){
+    uint32_t value = 0;
+    for(int i = 0; i < 4; i++) value |= (uint32_t)readByte() << (8 * i);
+    return value;
+}
+
+uint64_t LevcReader::readU64(){
+    uint64_t value = 0;
+    for(int i = 0; i < 8; i++) value |= (uint64_t)readByte() << (8 * i);
+    return value;
+}
+
+std::string LevcReader::readString(){
+    uint32_t length = readU32();
+    if(failed || length > size - pos){
+        failed = true;
+        return "";
+    }
+    std::string strs((const char*)in + pos, length);
+    pos += length;
+    return strs;
+}
+
+value_t LevcReader::readConstant(){
+    switch(readByte()){
+        case LEVC_NIL: return NIL_VAL;
+        case LEVC_FALSE: return BOOL_VAL(false);
+        case LEVC_TRUE: return BOOL_VAL(true);
+        case LEVC_NUMBER:{
+            uint64_t bits = readU64();
+            double number;
+            memcpy(&number, &bits, sizeof(number));
+            return NUMBER_VAL(number);
+        }
+        case LEVC_STRING:{
+            std::string strs = readString();
+            if(failed) return NIL_VAL;
+            return OBJ_VAL(gc->copyString(strs));
+        }
+        case LEVC_FUNCTION:{
+            ObjFunction* function = readFunction();
+            if(function == NULL) return NIL_VAL;
+            return OBJ_VAL(function);
+        }
+        default:
+            failed = true;
+            return NIL_VAL;
+    }
+}
+
+ObjFunction* LevcReader::readFunction(){
+    ObjFunction* function = gc->allocateObject<ObjFunction>();
+    function->chunk = std::make_unique<Chunk>();
+    gc->pushRoot((Obj*)function);
+    Chunk* chunk = function->chunk.get();
+
+    function->name = readString();
+    uint32_t arity = readU32();
+    uint32_t upvalueCount = readU32();
+    if(arity > UINT8_COUNT || upvalueCount > UINT8_COUNT) failed = true;
+    function->arity = arity;
+    function->upvalueCount = failed ? 0 : upvalueCount;
+
+    uint32_t offset = readU32();
+    uint32_t length = readU32();
+    if(failed || offset > codeSize || length > codeSize - offset){
+        failed = true;
+    }
+    uint32_t runCount = readU32();
+    if(runCount > length) failed = true;
+    line_array lines;
+    for(uint32_t i = 0; i < runCount && !failed; i++){
+        LineRun run;
+        uint32_t runOffset = readU32();
+        run.line = readU32();
+        if(runOffset >= length) failed = true;
+        run.offset = runOffset;
+        lines.push_back(run);
+    }
+    if(!failed) chunk->mapCode(codeSection + offset, length, std::move(lines));
+    // caches are indexed by a 16-bit operand
+    uint32_t cacheCount = readU32();
+    if(cacheCount > UINT16_MAX + 1) failed = true;
+    for(uint32_t i = 0; i < cacheCount && !failed; i++){
+        chunk->addCache();
+    }
+
+    uint32_t constantCount = readU32();
+    if(constantCount > MAX_LONG_OPERAND + 1) failed = true;
+    for(uint32_t i = 0; i < constantCount && !failed; i++){
+        value_t val = readConstant();
+        chunk->addConstantToValue(val);
+        gc->writeBarrier((Obj*)function, val);
+    }
+    // the VM dispatches on the mapped code without checking it, so a
+    // damaged file has to be caught here
+    if(!failed){
+        function->stackSize = verifyFunction(function, globals->size());
+        if(function->stackSize < 0) failed = true;
+    }
+
+    gc->popRoot();
+    return failed ? NULL : function;
+}
+
+ObjFunction* LevcReader::read(LevcImage* image, uint64_t sourceHash, uint32_t flags){
+    in = image->data();
+    size = image->size();
+    pos = 0;
+    failed = false;
+
+    if(size < 4 || memcmp(in, LEVC_MAGIC, 4) != 0) return NULL;
+    pos = 4;
+    if(readU32() != LEVC_VERSION) return NULL;
+    if(readU64() != sourceHash) return NULL;
+    if(readU32() != flags) return NULL;
+    uint32_t codeOffset = readU32();
+    if(failed || codeOffset > size) return NULL;
+    codeSection = in + codeOffset;
+    codeSize = size - codeOffset;
+
+    // the code refers to globals by slot, so they have to come out in the
+    // same order they had when the file was written
+    uint32_t globalCount = readU32();
+    for(uint32_t i = 0; i < globalCount && !failed; i++){
+        std::string name = readString();
+        if(failed) return NULL;
+        int slot = globals->resolve(gc->copyString(name));
+        gc->writeBarrier(globals, slot);
+        if(slot != (int)i) return NULL;
+    }
+    if(failed) return NULL;
+
+    // the script is called with no arguments and no enclosing closure
+    ObjFunction* function = readFunction();
+    if(function == NULL || function->arity != 0 || function->upvalueCount != 0) return NULL;
+    return function;
+}
@@ -2,6 +2,7 @@
 #include <fstream>
 #include <string>
 #include <cstdlib>
+#include <vector>
 #include "chunk.hpp"
 #include "debug.hpp"
 #include "vm.hpp"
@@ -23,10 +24,85 @@ std::string readFile(std::string path){
     return buffer;
 }
 
-void runFile(std::string path){
+struct Options{
+    GcConfig gcConfig;
+    JitConfig jitConfig;
+    OutputConfig outputConfig;
+    StackConfig stackConfig;
+    bool gcStats{false};
+    bool cacheStats{false};
+    bool opcodePairs{false};
+    bool registers{false};
+    // reuse and refresh the compiled bytecode in <path>c
+    bool bytecodeCache{true};
+    // write the C++ translation of the script here instead of running it
+    std::string aotPath;
+};
+
+void runFile(std::string path, Options& options){
     std::string source = readFile(path);
-    VirtualMachine vm;
-    InterpretResult result = vm.interpret(source);
+    VirtualMachine vm(options.gcConfig, options.registers, options.jitConfig, options.outputConfig,
+                      options.stackConfig);
+    if(!options.aotPath.empty()){
+        if(!vm.translate(source, options.aotPath)){
+            std::cerr << "Could not translate " << path << " to " << options.aotPath << std::endl;
+        }
+        return;
+    }
+    InterpretResult result = options.bytecodeCache
+        ? vm.interpret(source, path + "c")
+        : vm.interpret(source);
+    if(options.gcStats) vm.printGcStats(std::cerr);
+    if(options.cacheStats) vm.printCacheStats(std::cerr);
+    if(options.opcodePairs) vm.printOpcodePairs(std::cerr, 20);
+}
+
+// Returns false on an unknown option.
+static bool parseOption(std::string arg, Options& options){
+    if(arg == "--gc-stats"){
+        options.gcStats = true;
+    }else if(arg == "--no-cache"){
+        options.bytecodeCache = false;
+    }else if(arg == "--ic-stats"){
+        options.cacheStats = true;
+    }else if(arg == "--opcode-pairs"){
+        options.opcodePairs = true;
+    }else if(arg == "--registers"){
+        options.registers = true;
+    }else if(arg.rfind("--aot=", 0) == 0){
+        options.aotPath = arg.substr(6);
+    }else if(arg == "--no-jit"){
+        options.jitConfig.enabled = false;
+    }else if(arg.rfind("--jit-threshold=", 0) == 0){
+        options.jitConfig.threshold = std::stoul(arg.substr(16));
+    }else if(arg == "--no-trace"){
+        options.jitConfig.traces = false;
+    }else if(arg.rfind("--trace-threshold=", 0) == 0){
+        options.jitConfig.traceThreshold = std::stoul(arg.substr(18));
+    }else if(arg.rfind("--output-size=", 0) == 0){
+        options.outputConfig.size = std::stoul(arg.substr(14));
+    }else if(arg == "--output-flush=auto"){
+        options.outputConfig.policy = FLUSH_AUTO;
+    }else if(arg == "--output-flush=line"){
+        options.outputConfig.policy = FLUSH_LINE;
+    }else if(arg == "--output-flush=full"){
+        options.outputConfig.policy = FLUSH_FULL;
+    }else if(arg.rfind("--max-frames=", 0) == 0){
+        options.stackConfig.maxFrames = std::stoul(arg.substr(13));
+    }else if(arg.rfind("--gc-threshold=", 0) == 0){
+        options.gcConfig.initialThreshold = std::stoul(arg.substr(15));
+    }else if(arg.rfind("--gc-grow=", 0) == 0){
+        options.gcConfig.growFactor = std::stod(arg.substr(10));
+    }else if(arg == "--gc-incremental"){
+        options.gcConfig.incremental = true;
+    }else if(arg.rfind("--gc-slice=", 0) == 0){
+        options.gcConfig.sliceBudget = std::stoul(arg.substr(11));
+    }else if(arg.rfind("--gc-nursery=", 0) == 0){
+        options.gcConfig.nurserySize = std::stoul(arg.substr(13));
+    }else{
+        return false;
+    }
+    return true;
 }
 
 static void repl(){
@@ -40,15 +116,41 @@ static void repl(){
 }
 
 int main(int argc, const char* argv[]){
-    Chunk chunk;
-    VirtualMachine vm;
-    argc = 2;
-    argv[1] = "../samples/class.lev";
-    if (argc == 1){
+    Options options;
+    std::vector<std::string> paths;
+    for(int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        if(arg.rfind("--", 0) != 0){
+            paths.push_back(arg);
+        }else if(!parseOption(arg, options)){
+            std::cout << "Unknown option " << arg << std::endl;
+            return 64;
+        }
+    }
+
+    if (paths.size() == 0){
         repl();
-    }else if (argc == 2){
-        runFile(argv[1]);
+    }else if (paths.size() == 1){
+        runFile(paths[0], options);
     }else{
-        std::cout << "Usage: clox [path] \n" << std::endl;
+        std::cout << "Usage: levi [options] [path] \n" << std::endl;
+        std::cout << "  --no-cache             do not read or write the <path>c bytecode cache" << std::endl;
+        std::cout << "  --registers            compile arithmetic on locals to register instructions" << std::endl;
+        std::cout << "  --aot=<path>           write the script translated to C++ to <path> instead of running it" << std::endl;
+        std::cout << "  --no-jit               never compile functions to machine code" << std::endl;
+        std::cout << "  --jit-threshold=<n>    calls after which a function is compiled" << std::endl;
+        std::cout << "  --no-trace             never compile loops to machine code" << std::endl;
+        std::cout << "  --trace-threshold=<n>  iterations after which a loop is traced" << std::endl;
+        std::cout << "  --output-size=<bytes>  print output held before it is written, 0 writes through" << std::endl;
+        std::cout << "  --output-flush=<when>  line, full or auto (line on a terminal, else full)" << std::endl;
+        std::cout << "  --max-frames=<n>       call depth at which a script fails with a stack overflow" << std::endl;
+        std::cout << "  --gc-stats             print collector statistics on exit" << std::endl;
+        std::cout << "  --gc-threshold=<bytes> heap size that triggers the first collection" << std::endl;
+        std::cout << "  --gc-grow=<factor>     heap growth factor between collections" << std::endl;
+        std::cout << "  --gc-nursery=<bytes>   young generation size, 0 disables it" << std::endl;
+        std::cout << "  --gc-incremental       mark and sweep in bounded slices" << std::endl;
+        std::cout << "  --gc-slice=<objects>   work done by one incremental slice" << std::endl;
+        std::cout << "  --ic-stats             print inline cache hit/miss counts on exit" << std::endl;
+        std::cout << "  --opcode-pairs         print the most executed instruction pairs on exit" << std::endl;
     }
 }
@@ -0,0 +1,478 @@
+#include <chrono>
+#include "memory.hpp"
+#include "vm.hpp"
+
+
+GarbageCollector::~GarbageCollector(){
+    for(Obj* list : {objects, youngObjects}){
+        Obj* object = list;
+        while(object != NULL){
+            Obj* next = object->next;
+            freeObject(object);
+            object = next;
+        }
+    }
+}
+
+size_t GarbageCollector::objectSize(Obj* object){
+    switch(object->type){
+        case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+        case OBJ_CLASS: return sizeof(ObjClass);
+        case OBJ_CLOSURE:
+            return sizeof(ObjClosure) +
+                ((ObjClosure*)object)->upvalueCount * sizeof(ObjUpvalue*);
+        case OBJ_FUNCTION: return sizeof(ObjFunction);
+        case OBJ_INSTANCE: return sizeof(ObjInstance);
+        case OBJ_NATIVE: return sizeof(ObjNative);
+        case OBJ_STRING: return sizeof(ObjString) + ((ObjString*)object)->length;
+        case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+    }
+    return 0;
+}
+
+void GarbageCollector::track(Obj* object){
+    size_t size = objectSize(object);
+    bytesAllocated += size;
+    stats.totalAllocated += size;
+    if(config.nurserySize > 0){
+        youngBytes += size;
+        object->next = youngObjects;
+        youngObjects = object;
+    }else{
+        object->isOld = true;
+        object->next = objects;
+        objects = object;
+        if(phase == GC_MARKING){
+            // allocated gray, its fields are traced by a later slice
+            object->isMarked = true;
+            grayStack.push_back(object);
+        }else if(phase == GC_SWEEPING && sweepLink == &objects){
+            // keep the sweep cursor behind the new head
+            sweepLink = &object->next;
+        }
+    }
+    #ifdef DEBUG_LOG_GC
+        std::cout << (void*)object << " allocate " << size << " for " << object->type << std::endl;
+    #endif
+}
+
+void GarbageCollector::collectIfNeeded(){
+    #ifdef DEBUG_STRESS_GC
+        if(config.incremental){
+            if(phase == GC_IDLE) startCycle();
+            step();
+        }else if(config.nurserySize > 0){
+            collectNursery();
+        }else{
+            collectGarbage();
+        }
+    #else
+        if(config.incremental){
+            if(phase != GC_IDLE){
+                step();
+            }else if(bytesAllocated > nextGC){
+                startCycle();
+            }
+        }else if(config.nurserySize > 0 && youngBytes > config.nurserySize){
+            collectNursery();
+        }else if(bytesAllocated > nextGC){
+            collectGarbage();
+        }
+    #endif
+}
+
+ObjString* GarbageCollector::copyString(std::string strs){
+    uint32_t hash = Object::hashString(strs.data(), strs.size());
+    auto interned = strings.find(InternKey{strs, hash});
+    if(interned != strings.end()) return interned->second;
+
+    collectIfNeeded();
+    ObjString* objString = new ObjString;
+    Object::getObjString(std::move(strs), objString);
+    track((Obj*)objString);
+    strings[InternKey{objString->strs, hash}] = objString;
+    return objString;
+}
+
+// Called between marking and sweeping so that a string which is about to
+// be freed can not be handed out again by copyString.
+void GarbageCollector::removeWhiteStrings(){
+    for(auto entry = strings.begin(); entry != strings.end();){
+        if(!entry->second->obj.isMarked){
+            entry = strings.erase(entry);
+        }else{
+            entry++;
+        }
+    }
+}
+
+void GarbageCollector::freeObject(Obj* object){
+    size_t size = objectSize(object);
+    bytesAllocated -= size;
+    stats.totalFreed += size;
+    #ifdef DEBUG_LOG_GC
+        std::cout << (void*)object << " free type " << object->type << std::endl;
+    #endif
+    if(object->type == OBJ_STRING){
+        ObjString* string = (ObjString*)object;
+        auto interned = strings.find(InternKey{string->strs, string->hash});
+        if(interned != strings.end() && interned->second == string){
+            strings.erase(interned);
+        }
+    }
+    switch(object->type){
+        case OBJ_BOUND_METHOD: delete (ObjBoundMethod*)object; break;
+        case OBJ_CLASS: delete (ObjClass*)object; break;
+        case OBJ_CLOSURE: delete (ObjClosure*)object; break;
+        case OBJ_FUNCTION: delete (ObjFunction*)object; break;
+        case OBJ_INSTANCE: delete (ObjInstance*)object; break;
+        case OBJ_NATIVE: delete (ObjNative*)object; break;
+        case OBJ_STRING: delete (ObjString*)object; break;
+        case OBJ_UPVALUE: delete (ObjUpvalue*)object; break;
+    }
+}
+
+void GarbageCollector::markObject(Obj* object){
+    if(object == NULL) return;
+    if(object->isMarked) return;
+    // a minor collection treats the old generation as live
+    if(minorCollection && object->isOld) return;
+    #ifdef DEBUG_LOG_GC
+        std::cout << (void*)object << " mark ";
+        Value::printValue(OBJ_VAL(object));
+        std::cout << std::endl;
+    #endif
+    object->isMarked = true;
+    grayStack.push_back(object);
+}
+
+void GarbageCollector::markValue(value_t val){
+    if(IS_OBJ(val)) markObject(AS_OBJ(val));
+}
+
+void GarbageCollector::markRoots(){
+    for(stack_iter slot = vm->stack_memory->begin(); slot < vm->stack_ptr; slot++){
+        markValue(*slot);
+    }
+    for(int i = 0; i < vm->frameCount; i++){
+        markObject((Obj*)vm->frames[i].closure);
+    }
+    for(ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next){
+        markObject((Obj*)upvalue);
+    }
+    if(minorCollection){
+        for(int slot : rememberedGlobals){
+            markObject((Obj*)vm->globals.names[slot]);
+            markValue(vm->globals.values[slot]);
+        }
+    }else{
+        for(int slot = 0; slot < vm->globals.size(); slot++){
+            markObject((Obj*)vm->globals.names[slot]);
+            markValue(vm->globals.values[slot]);
+        }
+    }
+    // property names held by shapes, a minor collection only needs the
+    // shapes created since the previous one
+    int firstShape = minorCollection ? shapesMarked : 0;
+    for(int i = firstShape; i < vm->shapes.size(); i++){
+        markObject((Obj*)vm->shapes.at(i)->name);
+    }
+    markObject((Obj*)vm->initString);
+    // functions the compiler is still filling in
+    for(Obj* object : roots){
+        markObject(object);
+    }
+}
+
+void GarbageCollector::blackenObject(Obj* object){
+    switch(object->type){
+        case OBJ_BOUND_METHOD:{
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            markValue(bound->receiver);
+            markObject((Obj*)bound->method);
+            break;
+        }
+        case OBJ_CLASS:{
+            ObjClass* klass = (ObjClass*)object;
+            markObject((Obj*)klass->name);
+            for(auto& method : klass->methods){
+                markObject((Obj*)method.first);
+                markValue(method.second);
+            }
+            break;
+        }
+        case OBJ_CLOSURE:{
+            ObjClosure* closure = (ObjClosure*)object;
+            markObject((Obj*)closure->function);
+            for(ObjUpvalue* upvalue : closure->upvalues){
+                markObject((Obj*)upvalue);
+            }
+            break;
+        }
+        case OBJ_FUNCTION:{
+            ObjFunction* function = (ObjFunction*)object;
+            for(int i = 0; i < function->chunk->getValueSize(); i++){
+                markValue(function->chunk->getValue(i));
+            }
+            for(int i = 0; i < function->chunk->getCacheSize(); i++){
+                InlineCache* cache = function->chunk->getCache(i);
+                for(int j = 0; j < cache->count; j++){
+                    markObject((Obj*)cache->entries[j].klass);
+                    markObject((Obj*)cache->entries[j].method);
+                }
+            }
+            break;
+        }
+        case OBJ_INSTANCE:{
+            ObjInstance* instance = (ObjInstance*)object;
+            markObject((Obj*)instance->klass);
+            for(value_t field : instance->fields){
+                markValue(field);
+            }
+            break;
+        }
+        case OBJ_UPVALUE:
+            markValue(((ObjUpvalue*)object)->closed);
+            break;
+        case OBJ_NATIVE:
+        case OBJ_STRING:
+            break;
+    }
+}
+
+void GarbageCollector::traceReferences(){
+    while(!grayStack.empty()){
+        Obj* object = grayStack.back();
+        grayStack.pop_back();
+        blackenObject(object);
+    }
+}
+
+void GarbageCollector::sweep(){
+    Obj* previous = NULL;
+    Obj* object = objects;
+    while(object != NULL){
+        if(object->isMarked){
+            object->isMarked = false;
+            previous = object;
+            object = object->next;
+        }else{
+            Obj* unreached = object;
+            object = object->next;
+            if(previous != NULL){
+                previous->next = object;
+            }else{
+                objects = object;
+            }
+            freeObject(unreached);
+        }
+    }
+}
+
+// Survivors of the nursery are promoted by moving them onto the old list,
+// the objects themselves stay where they were allocated.
+void GarbageCollector::sweepNursery(){
+    Obj* object = youngObjects;
+    while(object != NULL){
+        Obj* next = object->next;
+        if(object->isMarked){
+            object->isMarked = false;
+            object->isOld = true;
+            object->next = objects;
+            objects = object;
+            stats.totalPromoted += objectSize(object);
+        }else{
+            freeObject(object);
+        }
+        object = next;
+    }
+    youngObjects = NULL;
+    youngBytes = 0;
+}
+
+void GarbageCollector::clearRemembered(){
+    for(Obj* object : rememberedSet){
+        object->isRemembered = false;
+    }
+    rememberedSet.clear();
+    rememberedGlobals.clear();
+}
+
+void GarbageCollector::collectNursery(){
+    auto start = std::chrono::steady_clock::now();
+    #ifdef DEBUG_LOG_GC
+        std::cout << "-- minor gc begin" << std::endl;
+        size_t before = bytesAllocated;
+    #endif
+
+    minorCollection = true;
+    markRoots();
+    for(Obj* object : rememberedSet){
+        blackenObject(object);
+    }
+    traceReferences();
+    sweepNursery();
+    clearRemembered();
+    shapesMarked = vm->shapes.size();
+    minorCollection = false;
+
+    std::chrono::duration<double> pause = std::chrono::steady_clock::now() - start;
+    stats.minorCollections++;
+    recordPause(pause.count());
+    #ifdef DEBUG_LOG_GC
+        std::cout << "-- minor gc end" << std::endl;
+        std::cout << "   collected " << before - bytesAllocated << " bytes" << std::endl;
+    #endif
+
+    if(bytesAllocated > nextGC) collectGarbage();
+}
+
+void GarbageCollector::collectGarbage(){
+    if(phase != GC_IDLE){
+        finishCycle();
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    #ifdef DEBUG_LOG_GC
+        std::cout << "-- gc begin" << std::endl;
+        size_t before = bytesAllocated;
+    #endif
+
+    markRoots();
+    traceReferences();
+    // the remembered set can hold old objects the sweep is about to free,
+    // and every survivor is old afterwards, so nothing needs remembering
+    clearRemembered();
+    sweep();
+    sweepNursery();
+    nextGC = bytesAllocated * config.growFactor;
+    if(nextGC < config.initialThreshold) nextGC = config.initialThreshold;
+
+    std::chrono::duration<double> pause = std::chrono::steady_clock::now() - start;
+    stats.collections++;
+    recordPause(pause.count());
+    #ifdef DEBUG_LOG_GC
+        std::cout << "-- gc end" << std::endl;
+        std::cout << "   collected " << before - bytesAllocated << " bytes (from "
+                  << before << " to " << bytesAllocated << ") next at " << nextGC << std::endl;
+    #endif
+}
+
+// Incremental cycles shade the roots in one short pause, then alternate
+// marking slices with the mutator. Once the gray stack drains the roots are
+// scanned again, since stack and frame writes are not barriered, and the heap
+// is swept a slice at a time.
+void GarbageCollector::startCycle(){
+    auto start = std::chrono::steady_clock::now();
+    #ifdef DEBUG_LOG_GC
+        std::cout << "-- incremental gc begin" << std::endl;
+    #endif
+    phase = GC_MARKING;
+    markRoots();
+    std::chrono::duration<double> pause = std::chrono::steady_clock::now() - start;
+    recordPause(pause.count());
+}
+
+void GarbageCollector::step(){
+    auto start = std::chrono::steady_clock::now();
+    if(phase == GC_MARKING){
+        if(grayStack.empty()){
+            finishMarking();
+        }else{
+            for(size_t work = 0; work < config.sliceBudget && !grayStack.empty(); work++){
+                Obj* object = grayStack.back();
+                grayStack.pop_back();
+                blackenObject(object);
+            }
+        }
+    }else if(phase == GC_SWEEPING){
+        sweepSlice(config.sliceBudget);
+    }
+    stats.slices++;
+    std::chrono::duration<double> pause = std::chrono::steady_clock::now() - start;
+    recordPause(pause.count());
+}
+
+void GarbageCollector::finishMarking(){
+    markRoots();
+    traceReferences();
+    removeWhiteStrings();
+    phase = GC_SWEEPING;
+    sweepLink = &objects;
+}
+
+void GarbageCollector::sweepSlice(size_t budget){
+    for(size_t work = 0; work < budget && *sweepLink != NULL; work++){
+        Obj* object = *sweepLink;
+        if(object->isMarked){
+            object->isMarked = false;
+            sweepLink = &object->next;
+        }else{
+            *sweepLink = object->next;
+            freeObject(object);
+        }
+    }
+    if(*sweepLink == NULL){
+        phase = GC_IDLE;
+        sweepLink = NULL;
+        nextGC = bytesAllocated * config.growFactor;
+        if(nextGC < config.initialThreshold) nextGC = config.initialThreshold;
+        stats.collections++;
+        #ifdef DEBUG_LOG_GC
+            std::cout << "-- incremental gc end, next at " << nextGC << std::endl;
+        #endif
+    }
+}
+
+void GarbageCollector::finishCycle(){
+    auto start = std::chrono::steady_clock::now();
+    if(phase == GC_MARKING) finishMarking();
+    if(phase == GC_SWEEPING) sweepSlice(SIZE_MAX);
+    std::chrono::duration<double> pause = std::chrono::steady_clock::now() - start;
+    recordPause(pause.count());
+}
+
+void GarbageCollector::recordPause(double seconds){
+    stats.totalPause += seconds;
+    if(seconds > stats.maxPause) stats.maxPause = seconds;
+    int bucket = 0;
+    double micros = seconds * 1e6;
+    while(bucket < GC_PAUSE_BUCKETS - 1 && micros >= (double)(1 << bucket)){
+        bucket++;
+    }
+    stats.pauseHistogram[bucket]++;
+}
+
+void GarbageCollector::printStats(std::ostream& out){
+    out << "[gc] collections: " << stats.collections
+        << " minor: " << stats.minorCollections << std::endl;
+    out << "[gc] bytes allocated: " << stats.totalAllocated
+        << " freed: " << stats.totalFreed
+        << " promoted: " << stats.totalPromoted
+        << " live: " << bytesAllocated << std::endl;
+    out << "[gc] pause total: " << stats.totalPause * 1000 << " ms"
+        << " max: " << stats.maxPause * 1000 << " ms";
+    if(config.incremental) out << " slices: " << stats.slices;
+    out << std::endl;
+
+    size_t pauses = 0;
+    for(size_t count : stats.pauseHistogram) pauses += count;
+    size_t seen = 0;
+    bool p99Reported = false;
+    for(int i = 0; i < GC_PAUSE_BUCKETS; i++){
+        seen += stats.pauseHistogram[i];
+        if(stats.pauseHistogram[i] == 0) continue;
+        out << "[gc]   ";
+        if(i == GC_PAUSE_BUCKETS - 1){
+            out << ">= " << (1 << (i - 1)) << " us: ";
+        }else{
+            out << "< " << (1 << i) << " us: ";
+        }
+        out << stats.pauseHistogram[i];
+        if(!p99Reported && seen * 100 >= pauses * 99){
+            out << "  <- p99";
+            p99Reported = true;
+        }
+        out << std::endl;
+    }
+}
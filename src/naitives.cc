@@ -1,6 +1,12 @@
 #include "naitives.hpp"
+#include "vm.hpp"
 
 
-value_t clockNative(int argCount, stack_iter args) {
+value_t clockNative(VirtualMachine* vm, int argCount, value_t* args) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+}
+
+value_t flushNative(VirtualMachine* vm, int argCount, value_t* args) {
+  vm->flushOutput();
+  return NIL_VAL;
 }
\ No newline at end of file
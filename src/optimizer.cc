@@ -0,0 +1,275 @@
+#include <vector>
+#include <algorithm>
+#include "optimizer.hpp"
+
+struct Instruction{
+    int offset;
+    int length;
+    uint8_t op;
+    int target{-1};     // offset a jump lands on
+    bool isTarget{false};
+    bool removed{false};
+    int newOffset{0};
+    // operands of a fused instruction, the others keep their original bytes
+    std::vector<uint8_t> operands;
+};
+
+static bool isJump(uint8_t op){
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP
+        || op == OP_LESS_JUMP_IF_FALSE || op == OP_R_LESS_JUMP;
+}
+
+static uint8_t registerOp(uint8_t op){
+    switch(op){
+        case OP_ADD: return OP_R_ADD;
+        case OP_SUBTRACT: return OP_R_SUBTRACT;
+        case OP_MULTIPLY: return OP_R_MULTIPLY;
+        case OP_DIVIDE: return OP_R_DIVIDE;
+        case OP_LESS: return OP_R_LESS;
+        case OP_GREATER: return OP_R_GREATER;
+        default: return 0;
+    }
+}
+
+static uint8_t fusedOp(uint8_t first, uint8_t second){
+    if(second == OP_NOT){
+        switch(first){
+            case OP_EQUAL: return OP_NOT_EQUAL;
+            case OP_LESS: return OP_GREATER_EQUAL;
+            case OP_GREATER: return OP_LESS_EQUAL;
+            default: return 0;
+        }
+    }
+    if(first == OP_SET_LOCAL && second == OP_POP) return OP_SET_LOCAL_POP;
+    return 0;
+}
+
+// Replaces instructions[i] with op and removes the count - 1 instructions
+// after it, unless a jump lands on one of those.
+static bool fuse(std::vector<Instruction>& instructions, size_t i, int count,
+                 uint8_t op, std::vector<uint8_t> operands){
+    if(i + count > instructions.size()) return false;
+    for(int j = 1; j < count; j++){
+        if(instructions[i+j].isTarget) return false;
+    }
+    Instruction& fused = instructions[i];
+    fused.op = op;
+    fused.operands = std::move(operands);
+    fused.length = 1 + fused.operands.size() + (isJump(op) ? 2 : 0);
+    for(int j = 1; j < count; j++){
+        instructions[i+j].removed = true;
+    }
+    return true;
+}
+
+// Rewrites a stack sequence at instructions[i] whose operands are locals
+// or constants into one register instruction. Operands are only folded
+// when they are pushed right before their operator, so reading them later
+// cannot observe a different value.
+static int fuseRegisters(std::vector<Instruction>& instructions, std::vector<int>& indexAt,
+                         const chunk_array& code, size_t i){
+    auto opAt = [&](size_t j) -> int {
+        return j < instructions.size() ? instructions[j].op : -1;
+    };
+    auto operand = [&](size_t j) -> uint8_t {
+        return code[instructions[j].offset + 1];
+    };
+    // a local or constant push that fits a register operand
+    auto leaf = [&](size_t j, uint8_t* spec) -> bool {
+        if(opAt(j) == OP_GET_LOCAL && operand(j) < REGISTER_STACK){
+            *spec = operand(j);
+            return true;
+        }
+        if(opAt(j) == OP_CONSTANT && operand(j) < REGISTER_CONSTANT){
+            *spec = REGISTER_CONSTANT | operand(j);
+            return true;
+        }
+        return false;
+    };
+    // an assignment statement to a local, which becomes the destination
+    auto store = [&](size_t j, uint8_t* dst) -> int {
+        if(opAt(j) == OP_SET_LOCAL && opAt(j+1) == OP_POP && operand(j) != 0){
+            *dst = operand(j);
+            return 2;
+        }
+        *dst = 0;
+        return 0;
+    };
+
+    uint8_t a, b, dst;
+    if(leaf(i, &a) && leaf(i+1, &b) && opAt(i+2) == OP_LESS
+        && opAt(i+3) == OP_JUMP_IF_FALSE && opAt(i+4) == OP_POP){
+        int target = instructions[i+3].target;
+        if(target < (int)code.size() && code[target] == OP_POP){
+            size_t after = indexAt[target] + 1;
+            if(after < instructions.size() && fuse(instructions, i, 5, OP_R_LESS_JUMP, {a, b})){
+                instructions[i].target = instructions[after].offset;
+                instructions[after].isTarget = true;
+                return 5;
+            }
+        }
+    }
+    if(leaf(i, &a) && leaf(i+1, &b) && registerOp(opAt(i+2))){
+        int count = 3 + store(i+3, &dst);
+        if(fuse(instructions, i, count, registerOp(opAt(i+2)), {dst, a, b})) return count;
+    }
+    // the left operand is whatever is on the stack
+    if(leaf(i, &b) && registerOp(opAt(i+1))){
+        int count = 2 + store(i+2, &dst);
+        if(fuse(instructions, i, count, registerOp(opAt(i+1)), {dst, REGISTER_STACK, b})) return count;
+    }
+    if(leaf(i, &a) && store(i+1, &dst) && fuse(instructions, i, 3, OP_R_MOVE, {dst, a})){
+        return 3;
+    }
+    return 1;
+}
+
+// Tries the superinstructions at instructions[i], longest first, and
+// returns how many instructions were folded into it.
+static int fuseSequence(std::vector<Instruction>& instructions, std::vector<int>& indexAt,
+                        const chunk_array& code, size_t i, bool registers){
+    if(registers){
+        int fused = fuseRegisters(instructions, indexAt, code, i);
+        if(fused > 1) return fused;
+    }
+    auto opAt = [&](size_t j) -> int {
+        return j < instructions.size() ? instructions[j].op : -1;
+    };
+    auto operand = [&](size_t j) -> uint8_t {
+        return code[instructions[j].offset + 1];
+    };
+
+    if(opAt(i) == OP_GET_LOCAL && opAt(i+1) == OP_CONSTANT && opAt(i+2) == OP_ADD
+        && fuse(instructions, i, 3, OP_ADD_LOCAL_CONSTANT, {operand(i), operand(i+1)})){
+        return 3;
+    }
+    if(opAt(i) == OP_LESS && opAt(i+1) == OP_JUMP_IF_FALSE && opAt(i+2) == OP_POP){
+        // when false, the jump used to land on an OP_POP for the condition
+        // that the fused instruction has already consumed
+        int target = instructions[i+1].target;
+        if(target < (int)code.size() && code[target] == OP_POP){
+            size_t after = indexAt[target] + 1;
+            if(after < instructions.size() && fuse(instructions, i, 3, OP_LESS_JUMP_IF_FALSE, {})){
+                instructions[i].target = instructions[after].offset;
+                instructions[after].isTarget = true;
+                return 3;
+            }
+        }
+    }
+    if(opAt(i) == OP_GET_LOCAL && opAt(i+1) == OP_GET_LOCAL
+        && fuse(instructions, i, 2, OP_GET_LOCAL_LOCAL, {operand(i), operand(i+1)})){
+        return 2;
+    }
+    if(opAt(i) == OP_GET_LOCAL && operand(i) == 0 && opAt(i+1) == OP_GET_PROPERTY){
+        int offset = instructions[i+1].offset;
+        std::vector<uint8_t> operands(code.begin() + offset + 1, code.begin() + offset + 4);
+        if(fuse(instructions, i, 2, OP_GET_THIS_PROPERTY, operands)) return 2;
+    }
+    if(i + 1 < instructions.size()){
+        uint8_t op = fusedOp(instructions[i].op, instructions[i+1].op);
+        if(op != 0){
+            std::vector<uint8_t> operands(code.begin() + instructions[i].offset + 1,
+                code.begin() + instructions[i].offset + instructions[i].length);
+            if(fuse(instructions, i, 2, op, operands)) return 2;
+        }
+    }
+    return 1;
+}
+
+void optimizeChunk(Chunk* chunk, bool registers){
+    const chunk_array& code = *chunk->getChunk();
+    int size = code.size();
+
+    std::vector<Instruction> instructions;
+    // index of the instruction starting at each offset, -1 inside operands;
+    // size maps to one past the last instruction
+    std::vector<int> indexAt(size + 1, -1);
+    for(int offset = 0; offset < size;){
+        Instruction instruction;
+        instruction.offset = offset;
+        instruction.length = chunk->instructionLength(offset);
+        instruction.op = code[offset];
+        if(isJump(instruction.op)){
+            int distance = (code[offset+1] << 8) | code[offset+2];
+            int next = offset + 3;
+            instruction.target = instruction.op == OP_LOOP ? next - distance : next + distance;
+        }
+        indexAt[offset] = instructions.size();
+        instructions.push_back(instruction);
+        offset += instruction.length;
+    }
+    indexAt[size] = instructions.size();
+
+    bool changed = false;
+    // thread jump chains, the code only jumps forward so they end
+    for(Instruction& instruction : instructions){
+        if(instruction.op != OP_JUMP && instruction.op != OP_JUMP_IF_FALSE) continue;
+        for(;;){
+            if(instruction.target >= size) break;
+            Instruction& next = instructions[indexAt[instruction.target]];
+            bool follows = next.op == OP_JUMP
+                || (instruction.op == OP_JUMP_IF_FALSE && next.op == OP_JUMP_IF_FALSE);
+            if(!follows) break;
+            // fusing only shrinks the code, so an offset that fits now fits later
+            if(next.target - (instruction.offset + 3) > UINT16_MAX) break;
+            instruction.target = next.target;
+            changed = true;
+        }
+    }
+    for(Instruction& instruction : instructions){
+        if(instruction.target >= 0 && instruction.target < size){
+            instructions[indexAt[instruction.target]].isTarget = true;
+        }
+    }
+
+    for(size_t i = 0; i < instructions.size();){
+        int fused = fuseSequence(instructions, indexAt, code, i, registers);
+        if(fused > 1) changed = true;
+        i += fused;
+    }
+    if(!changed) return;
+
+    int newSize = 0;
+    for(Instruction& instruction : instructions){
+        instruction.newOffset = newSize;
+        if(!instruction.removed) newSize += instruction.length;
+    }
+
+    chunk_array rewritten;
+    rewritten.reserve(newSize);
+    for(Instruction& instruction : instructions){
+        if(instruction.removed) continue;
+        rewritten.push_back(instruction.op);
+        if(isJump(instruction.op)){
+            rewritten.insert(rewritten.end(), instruction.operands.begin(), instruction.operands.end());
+            int newTarget = instruction.target >= size
+                ? newSize : instructions[indexAt[instruction.target]].newOffset;
+            int next = instruction.newOffset + instruction.length;
+            int distance = instruction.op == OP_LOOP ? next - newTarget : newTarget - next;
+            rewritten.push_back((distance >> 8) & 0xff);
+            rewritten.push_back(distance & 0xff);
+        }else if(!instruction.operands.empty()){
+            rewritten.insert(rewritten.end(), instruction.operands.begin(), instruction.operands.end());
+        }else{
+            rewritten.insert(rewritten.end(),
+                code.begin() + instruction.offset + 1,
+                code.begin() + instruction.offset + instruction.length);
+        }
+    }
+
+    // a run starting at a removed instruction now starts at whatever
+    // follows it, and replaces a run that would start at the same offset
+    line_array lines;
+    for(const LineRun& run : chunk->getLines()){
+        int index = std::upper_bound(instructions.begin(), instructions.end(), run.offset,
+            [](int offset, const Instruction& instruction){ return offset < instruction.offset; })
+            - instructions.begin() - 1;
+        int offset = instructions[index].newOffset;
+        if(offset >= newSize) break;
+        if(!lines.empty() && lines.back().offset == offset) lines.pop_back();
+        if(!lines.empty() && lines.back().line == run.line) continue;
+        lines.push_back(LineRun{offset, run.line});
+    }
+
+    chunk->replaceCode(std::move(rewritten), std::move(lines));
+}
@@ -0,0 +1,72 @@
+#include "output.hpp"
+#include "object.hpp"
+#include <cstring>
+#include <charconv>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+
+static bool isTerminal(FILE* file){
+#if defined(__unix__) || defined(__APPLE__)
+    return isatty(fileno(file));
+#else
+    return false;
+#endif
+}
+
+OutputBuffer::OutputBuffer(OutputConfig config, FILE* file)
+: file(file), buffer(config.size){
+    lineBuffered = config.policy == FLUSH_LINE
+        || (config.policy == FLUSH_AUTO && isTerminal(file));
+}
+
+void OutputBuffer::write(const char* data, size_t size){
+    if(size > buffer.size() - used){
+        flush();
+        // too big to buffer at all
+        if(size >= buffer.size()){
+            fwrite(data, 1, size, file);
+            fflush(file);
+            return;
+        }
+    }
+    memcpy(buffer.data() + used, data, size);
+    used += size;
+}
+
+void OutputBuffer::writeNumber(double number){
+    char text[32];
+#ifdef __cpp_lib_to_chars
+    // the precision std::cout uses by default, and the %g format it uses
+    char* end = std::to_chars(text, text + sizeof(text), number, std::chars_format::general, 6).ptr;
+    write(text, end - text);
+#else
+    write(text, snprintf(text, sizeof(text), "%g", number));
+#endif
+}
+
+void OutputBuffer::writeValue(value_t val){
+    if(IS_BOOL(val)){
+        if(AS_BOOL(val)) write("true", 4);
+        else write("false", 5);
+    }else if(IS_NIL(val)){
+        write("nil", 3);
+    }else if(IS_NUMBER(val)){
+        writeNumber(AS_NUMBER(val));
+    }else if(IS_STRING(val)){
+        write(AS_CSTRING(val));
+    }else if(IS_OBJ(val)){
+        write(Object::toString(val));
+    }
+}
+
+void OutputBuffer::newline(){
+    write("\n", 1);
+    if(lineBuffered) flush();
+}
+
+void OutputBuffer::flush(){
+    if(used > 0) fwrite(buffer.data(), 1, used, file);
+    used = 0;
+    fflush(file);
+}
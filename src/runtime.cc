@@ -0,0 +1,126 @@
+#include "runtime.hpp"
+#include "vm.hpp"
+
+void Runtime::storeStack(VirtualMachine* vm, value_t* sp){
+    vm->stack_ptr = vm->stack_memory->begin() + (sp - vm->stack_memory->data());
+}
+
+value_t* Runtime::loadStack(VirtualMachine* vm){
+    return vm->stack_memory->data() + (vm->stack_ptr - vm->stack_memory->begin());
+}
+
+static uint32_t globalOperand(const uint8_t* ip, uint8_t shortOp){
+    if(*ip == shortOp) return ip[1];
+    return (ip[1] << 16) | (ip[2] << 8) | ip[3];
+}
+
+value_t* Runtime::getGlobal(VirtualMachine* vm, value_t* sp, const uint8_t* ip){
+    value_t val = vm->globals.values[globalOperand(ip, OP_GET_GLOBAL)];
+    if(IS_UNDEFINED(val)) return NULL;
+    *sp++ = val;
+    return sp;
+}
+
+value_t* Runtime::setGlobal(VirtualMachine* vm, value_t* sp, const uint8_t* ip){
+    uint32_t slot = globalOperand(ip, OP_SET_GLOBAL);
+    if(IS_UNDEFINED(vm->globals.values[slot])) return NULL;
+    vm->globals.values[slot] = sp[-1];
+    vm->gc.writeBarrier(&vm->globals, slot);
+    return sp;
+}
+
+value_t* Runtime::defineGlobal(VirtualMachine* vm, value_t* sp, const uint8_t* ip){
+    uint32_t slot = globalOperand(ip, OP_DEFINE_GLOBAL);
+    vm->globals.values[slot] = sp[-1];
+    vm->gc.writeBarrier(&vm->globals, slot);
+    return sp - 1;
+}
+
+value_t* Runtime::getUpvalue(VirtualMachine* vm, value_t* sp, const uint8_t* ip){
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    *sp++ = *frame->closure->upvalues[ip[1]]->location;
+    return sp;
+}
+
+value_t* Runtime::setUpvalue(VirtualMachine* vm, value_t* sp, const uint8_t* ip){
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    ObjUpvalue* upvalue = frame->closure->upvalues[ip[1]];
+    *upvalue->location = sp[-1];
+    vm->gc.writeBarrier((Obj*)upvalue, sp[-1]);
+    return sp;
+}
+
+// Only fields the inline cache already knows about, the interpreter fills
+// the cache and binds methods.
+value_t* Runtime::getProperty(VirtualMachine* vm, value_t* sp, const uint8_t* ip){
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    value_t receiver = *ip == OP_GET_THIS_PROPERTY ? frame->slots[-1] : sp[-1];
+    if(!IS_INSTANCE(receiver)) return NULL;
+    ObjInstance* instance = AS_INSTANCE(receiver);
+    InlineCache* cache = frame->closure->function->chunk->getCache((ip[2] << 8) | ip[3]);
+    CacheEntry* entry = cache->find(instance->shape, instance->klass);
+    if(entry == NULL || entry->method != NULL) return NULL;
+    vm->cacheStats.hits++;
+    if(*ip == OP_GET_PROPERTY) sp--;
+    *sp++ = instance->fields[entry->slot];
+    return sp;
+}
+
+value_t* Runtime::setProperty(VirtualMachine* vm, value_t* sp, const uint8_t* ip){
+    if(!IS_INSTANCE(sp[-2])) return NULL;
+    ObjInstance* instance = AS_INSTANCE(sp[-2]);
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    InlineCache* cache = frame->closure->function->chunk->getCache((ip[2] << 8) | ip[3]);
+    CacheEntry* entry = cache->find(instance->shape, NULL);
+    if(entry == NULL) return NULL;
+    vm->cacheStats.hits++;
+    if(entry->next != NULL){
+        instance->shape = entry->next;
+        instance->fields.push_back(sp[-1]);
+    }else{
+        instance->fields[entry->slot] = sp[-1];
+    }
+    vm->gc.writeBarrier((Obj*)instance, sp[-1]);
+    sp[-2] = sp[-1];
+    return sp - 1;
+}
+
+value_t* Runtime::equal(VirtualMachine* vm, value_t* sp, const uint8_t* ip){
+    bool equal = Value::valuesEqual(sp[-2], sp[-1]);
+    sp[-2] = BOOL_VAL(*ip == OP_EQUAL ? equal : !equal);
+    return sp - 1;
+}
+
+// The string case of the instructions that add, numbers are added inline.
+value_t* Runtime::add(VirtualMachine* vm, value_t* sp, const uint8_t* ip){
+    if(*ip == OP_ADD_LOCAL_CONSTANT){
+        CallFrame* frame = &vm->frames[vm->frameCount - 1];
+        value_t a = frame->slots[ip[1]-1];
+        value_t b = frame->closure->function->chunk->getValue(ip[2]);
+        if(!IS_STRING(a) || !IS_STRING(b)) return NULL;
+        *sp++ = a;
+        *sp++ = b;
+    }else if(!IS_STRING(sp[-2]) || !IS_STRING(sp[-1])){
+        return NULL;
+    }
+    storeStack(vm, sp);
+    vm->concatenate();
+    return loadStack(vm);
+}
+
+value_t* Runtime::print(VirtualMachine* vm, value_t* sp, const uint8_t* ip){
+    vm->output.writeValue(sp[-1]);
+    vm->output.newline();
+    return sp - 1;
+}
+
+value_t* Runtime::closeUpvalue(VirtualMachine* vm, value_t* sp, const uint8_t* ip){
+    vm->closeUpvalues(sp - 1);
+    return sp - 1;
+}
+
+value_t* Runtime::safepoint(VirtualMachine* vm, value_t* sp, const uint8_t* ip){
+    storeStack(vm, sp);
+    vm->gc.safepoint();
+    return sp;
+}
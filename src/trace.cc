@@ -0,0 +1,716 @@
+#include "trace.hpp"
+#include "x64.hpp"
+#include "vm.hpp"
+#include <algorithm>
+
+// rdi the frame's slots, rsi the stack top at the loop header and rdx the
+// frame
+using TraceEntry = value_t* (*)(value_t*, value_t*, CallFrame*);
+
+// times a loop is recorded before it is left with the trace it has, or
+// with none
+#define TRACE_MAX_RECORDINGS 4
+
+value_t* Tracer::enter(VirtualMachine* vm, CallFrame* frame, value_t* sp){
+    ObjFunction* function = frame->closure->function;
+    Trace* trace = NULL;
+    for(const std::unique_ptr<Trace>& candidate : function->traces){
+        if(candidate->header == frame->ip){
+            trace = candidate.get();
+            break;
+        }
+    }
+    if(trace == NULL){
+        function->traces.push_back(std::make_unique<Trace>(frame->ip));
+        trace = function->traces.back().get();
+    }
+    if(!trace->recorded && ++trace->hits >= vm->jitConfig.traceThreshold){
+        trace->recorded = true;
+        trace->recordings++;
+        // the iteration may have been the one leaving the loop, so a loop
+        // that could not be recorded is tried again later, and one that
+        // is recorded again keeps its old trace until then
+        if(!record(vm, frame, sp, trace) && trace->recordings < TRACE_MAX_RECORDINGS){
+            trace->recorded = false;
+            trace->hits = 0;
+        }
+    }
+    if(trace->code == NULL) return sp;
+    TraceEntry entry = reinterpret_cast<TraceEntry>(trace->code->code);
+    value_t* top = entry(&*frame->slots, sp, frame);
+    if(frame->ip != trace->header && frame->ip >= trace->low && frame->ip <= trace->high
+       && ++trace->sideExits >= vm->jitConfig.traceThreshold && trace->recordings < TRACE_MAX_RECORDINGS){
+        trace->recorded = false;
+        trace->hits = 0;
+        trace->sideExits = 0;
+    }
+    return top;
+}
+
+#ifdef JIT_X64
+
+// instructions recorded before the loop is given up on
+#define TRACE_MAX_LENGTH 256
+// xmm0 is kept as a scratch register
+#define TRACE_REGISTERS 15
+
+// Each comparison is paired with its negation, so that the negation of
+// LESS is GREATER_EQUAL exactly as the interpreter defines it, NaN
+// operands included.
+enum TraceCompare{
+    COMPARE_LESS,
+    COMPARE_GREATER_EQUAL,
+    COMPARE_GREATER,
+    COMPARE_LESS_EQUAL,
+    COMPARE_EQUAL,
+    COMPARE_NOT_EQUAL
+};
+
+static TraceCompare negate(TraceCompare compare){
+    return (TraceCompare)(compare ^ 1);
+}
+
+static bool compareNumbers(TraceCompare compare, double a, double b){
+    switch(compare){
+        case COMPARE_LESS: return a < b;
+        case COMPARE_GREATER_EQUAL: return !(a < b);
+        case COMPARE_GREATER: return a > b;
+        case COMPARE_LESS_EQUAL: return !(a > b);
+        case COMPARE_EQUAL: return a == b;
+        default: return !(a == b);
+    }
+}
+
+// What the recorder knows about a stack entry: a number held by a trace
+// value, a boolean known when recording, or a comparison of two trace
+// values that only a branch can consume.
+struct TraceValue{
+    enum Kind{ NUMBER, BOOL, COMPARE } kind;
+    // the number, or the left operand of the comparison
+    int id{-1};
+    int right{-1};
+    TraceCompare compare{COMPARE_LESS};
+    // the boolean, or the outcome of the comparison when recording
+    bool boolean{false};
+    // the number when recording
+    double number{0};
+};
+
+enum TraceOpType{
+    TRACE_CONSTANT,     // dst = number
+    TRACE_GET,          // dst = local
+    TRACE_SET,          // local = a
+    TRACE_ARITHMETIC,   // dst = a sse b
+    TRACE_NEGATE,       // dst = -a
+    TRACE_GUARD         // leaves through exit unless a compare b holds
+};
+
+struct TraceOp{
+    TraceOpType type;
+    int dst{-1};
+    int a{-1};
+    int b{-1};
+    int local{-1};
+    uint8_t sse{0};
+    TraceCompare compare{COMPARE_LESS};
+    double number{0};
+    int exit{-1};
+};
+
+// Where a guard hands the loop back to the interpreter: the instruction it
+// continues with and the stack above the loop header's at that point.
+struct TraceExit{
+    const uint8_t* resume;
+    std::vector<TraceValue> stack;
+    int label{-1};
+};
+
+// Follows one iteration of the loop from its header.
+//
+// The locals below the stack top at the header live across iterations and
+// are read and written by TRACE_GET and TRACE_SET. Anything pushed in the
+// body, the body's own locals included, is tracked on the recorder's stack
+// and is gone again when the loop jumps back.
+class TraceRecorder{
+    public:
+        TraceRecorder(CallFrame* frame, value_t* sp);
+        bool record();
+
+        std::vector<TraceOp> ops;
+        std::vector<TraceExit> exits;
+        int values{0};
+        // locals of the frame the trace uses, and whether it writes them
+        std::vector<int> locals;
+        std::vector<bool> written;
+        const uint8_t* low;
+        const uint8_t* high;
+    private:
+        bool instruction();
+        bool pop(TraceValue& val);
+        bool popNumber(TraceValue& val);
+        void push(TraceValue val){ stack.push_back(val); }
+        bool constant(value_t val, TraceValue& result);
+        bool getLocal(uint8_t slot, TraceValue& result);
+        bool setLocal(uint8_t slot, TraceValue val);
+        bool readRegister(uint8_t spec, TraceValue& result);
+        bool writeRegister(uint8_t dst, TraceValue val);
+        TraceValue arithmetic(uint8_t sse, TraceValue a, TraceValue b);
+        TraceValue compare(TraceCompare compare, TraceValue a, TraceValue b);
+        bool guard(TraceValue condition, const uint8_t* resume);
+        bool branch(const uint8_t* next, uint16_t offset);
+
+        CallFrame* frame;
+        value_t* slots;
+        const value_t* constants;
+        const uint8_t* header;
+        const uint8_t* ip;
+        size_t depth;
+        std::vector<TraceValue> stack;
+        // number in each local of the frame when recording, and whether
+        // the trace has touched it yet
+        std::vector<double> current;
+        std::vector<bool> used;
+};
+
+TraceRecorder::TraceRecorder(CallFrame* frame, value_t* sp)
+: low(frame->ip), high(frame->ip), frame(frame), slots(&*frame->slots),
+  header(frame->ip), ip(frame->ip){
+    constants = frame->closure->function->chunk->getValues();
+    depth = sp - slots;
+    current.assign(depth, 0);
+    used.assign(depth, false);
+    written.assign(depth, false);
+}
+
+bool TraceRecorder::pop(TraceValue& val){
+    if(stack.empty()) return false;
+    val = stack.back();
+    stack.pop_back();
+    return true;
+}
+
+bool TraceRecorder::popNumber(TraceValue& val){
+    return pop(val) && val.kind == TraceValue::NUMBER;
+}
+
+bool TraceRecorder::constant(value_t val, TraceValue& result){
+    if(!IS_NUMBER(val)) return false;
+    TraceOp op{TRACE_CONSTANT};
+    op.dst = values++;
+    op.number = AS_NUMBER(val);
+    ops.push_back(op);
+    result = TraceValue{TraceValue::NUMBER};
+    result.id = op.dst;
+    result.number = op.number;
+    return true;
+}
+
+bool TraceRecorder::getLocal(uint8_t slot, TraceValue& result){
+    if(slot == 0) return false;
+    size_t index = slot - 1;
+    if(index >= depth){
+        if(index - depth >= stack.size()) return false;
+        result = stack[index - depth];
+        return true;
+    }
+    if(!used[index]){
+        if(!IS_NUMBER(slots[index])) return false;
+        current[index] = AS_NUMBER(slots[index]);
+        used[index] = true;
+        locals.push_back(index);
+    }
+    TraceOp op{TRACE_GET};
+    op.dst = values++;
+    op.local = index;
+    ops.push_back(op);
+    result = TraceValue{TraceValue::NUMBER};
+    result.id = op.dst;
+    result.number = current[index];
+    return true;
+}
+
+bool TraceRecorder::setLocal(uint8_t slot, TraceValue val){
+    if(slot == 0) return false;
+    size_t index = slot - 1;
+    if(index >= depth){
+        if(index - depth >= stack.size()) return false;
+        stack[index - depth] = val;
+        return true;
+    }
+    // the trace keeps the frame's locals unboxed
+    if(val.kind != TraceValue::NUMBER) return false;
+    if(!used[index]){
+        used[index] = true;
+        locals.push_back(index);
+    }
+    TraceOp op{TRACE_SET};
+    op.local = index;
+    op.a = val.id;
+    ops.push_back(op);
+    current[index] = val.number;
+    written[index] = true;
+    return true;
+}
+
+bool TraceRecorder::readRegister(uint8_t spec, TraceValue& result){
+    if(spec & REGISTER_CONSTANT) return constant(constants[spec & ~REGISTER_CONSTANT], result);
+    if(spec == REGISTER_STACK) return pop(result);
+    return getLocal(spec, result);
+}
+
+bool TraceRecorder::writeRegister(uint8_t dst, TraceValue val){
+    if(dst == 0){
+        push(val);
+        return true;
+    }
+    return setLocal(dst, val);
+}
+
+TraceValue TraceRecorder::arithmetic(uint8_t sse, TraceValue a, TraceValue b){
+    TraceOp op{TRACE_ARITHMETIC};
+    op.dst = values++;
+    op.a = a.id;
+    op.b = b.id;
+    op.sse = sse;
+    ops.push_back(op);
+    TraceValue result{TraceValue::NUMBER};
+    result.id = op.dst;
+    switch(sse){
+        case SSE_ADD: result.number = a.number + b.number; break;
+        case SSE_SUB: result.number = a.number - b.number; break;
+        case SSE_MUL: result.number = a.number * b.number; break;
+        default: result.number = a.number / b.number; break;
+    }
+    return result;
+}
+
+TraceValue TraceRecorder::compare(TraceCompare compare, TraceValue a, TraceValue b){
+    TraceValue result{TraceValue::COMPARE};
+    result.id = a.id;
+    result.right = b.id;
+    result.compare = compare;
+    result.boolean = compareNumbers(compare, a.number, b.number);
+    return result;
+}
+
+// Makes the trace go on only when condition comes out the way it did when
+// recording. The stack is the one the interpreter resumes with.
+bool TraceRecorder::guard(TraceValue condition, const uint8_t* resume){
+    for(const TraceValue& val : stack){
+        if(val.kind == TraceValue::COMPARE) return false;
+    }
+    TraceOp op{TRACE_GUARD};
+    op.a = condition.id;
+    op.b = condition.right;
+    op.compare = condition.boolean ? condition.compare : negate(condition.compare);
+    op.exit = exits.size();
+    ops.push_back(op);
+    exits.push_back(TraceExit{resume, stack});
+    return true;
+}
+
+// OP_JUMP_IF_FALSE, whose condition stays on the stack
+bool TraceRecorder::branch(const uint8_t* next, uint16_t offset){
+    if(stack.empty()) return false;
+    TraceValue& top = stack.back();
+    bool truthy;
+    switch(top.kind){
+        case TraceValue::NUMBER: truthy = true; break;
+        case TraceValue::BOOL: truthy = top.boolean; break;
+        default:{
+            TraceValue condition = top;
+            truthy = condition.boolean;
+            top = TraceValue{TraceValue::BOOL};
+            top.boolean = !truthy;
+            if(!guard(condition, truthy ? next + offset : next)) return false;
+            top.boolean = truthy;
+            break;
+        }
+    }
+    ip = truthy ? next : next + offset;
+    return true;
+}
+
+bool TraceRecorder::instruction(){
+    TraceValue a, b, result;
+    uint8_t op = *ip;
+    switch(op){
+        case OP_CONSTANT:
+            if(!constant(constants[ip[1]], result)) return false;
+            push(result);
+            ip += 2;
+            return true;
+        case OP_CONSTANT_LONG:
+            if(!constant(constants[(ip[1] << 16) | (ip[2] << 8) | ip[3]], result)) return false;
+            push(result);
+            ip += 4;
+            return true;
+        case OP_TRUE:
+        case OP_FALSE:
+            result = TraceValue{TraceValue::BOOL};
+            result.boolean = op == OP_TRUE;
+            push(result);
+            ip += 1;
+            return true;
+        case OP_POP:
+            ip += 1;
+            return pop(a);
+        case OP_GET_LOCAL:
+            if(!getLocal(ip[1], result)) return false;
+            push(result);
+            ip += 2;
+            return true;
+        case OP_SET_LOCAL:
+            if(stack.empty() || !setLocal(ip[1], stack.back())) return false;
+            ip += 2;
+            return true;
+        case OP_SET_LOCAL_POP:
+            if(!pop(a) || !setLocal(ip[1], a)) return false;
+            ip += 2;
+            return true;
+        case OP_GET_LOCAL_LOCAL:
+            if(!getLocal(ip[1], a)) return false;
+            push(a);
+            if(!getLocal(ip[2], b)) return false;
+            push(b);
+            ip += 3;
+            return true;
+        case OP_ADD_LOCAL_CONSTANT:
+            if(!getLocal(ip[1], a) || a.kind != TraceValue::NUMBER) return false;
+            if(!constant(constants[ip[2]], b)) return false;
+            push(arithmetic(SSE_ADD, a, b));
+            ip += 3;
+            return true;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:{
+            if(!popNumber(b) || !popNumber(a)) return false;
+            uint8_t sse = op == OP_SUBTRACT ? SSE_SUB : op == OP_MULTIPLY ? SSE_MUL
+                : op == OP_DIVIDE ? SSE_DIV : SSE_ADD;
+            push(arithmetic(sse, a, b));
+            ip += 1;
+            return true;
+        }
+        case OP_NEGATE:{
+            if(!popNumber(a)) return false;
+            TraceOp negate{TRACE_NEGATE};
+            negate.dst = values++;
+            negate.a = a.id;
+            ops.push_back(negate);
+            result = TraceValue{TraceValue::NUMBER};
+            result.id = negate.dst;
+            result.number = -a.number;
+            push(result);
+            ip += 1;
+            return true;
+        }
+        case OP_LESS:
+        case OP_LESS_NUM:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:{
+            if(!popNumber(b) || !popNumber(a)) return false;
+            TraceCompare kind = op == OP_GREATER ? COMPARE_GREATER
+                : op == OP_GREATER_EQUAL ? COMPARE_GREATER_EQUAL
+                : op == OP_LESS_EQUAL ? COMPARE_LESS_EQUAL
+                : op == OP_EQUAL ? COMPARE_EQUAL
+                : op == OP_NOT_EQUAL ? COMPARE_NOT_EQUAL : COMPARE_LESS;
+            push(compare(kind, a, b));
+            ip += 1;
+            return true;
+        }
+        case OP_NOT:{
+            if(stack.empty()) return false;
+            TraceValue& top = stack.back();
+            if(top.kind == TraceValue::COMPARE){
+                top.compare = negate(top.compare);
+                top.boolean = !top.boolean;
+            }else{
+                top.boolean = top.kind == TraceValue::BOOL && !top.boolean;
+                top.kind = TraceValue::BOOL;
+            }
+            ip += 1;
+            return true;
+        }
+        case OP_JUMP:
+            ip += 3 + ((ip[1] << 8) | ip[2]);
+            return true;
+        case OP_JUMP_IF_FALSE:
+            return branch(ip + 3, (ip[1] << 8) | ip[2]);
+        case OP_LESS_JUMP_IF_FALSE:
+        case OP_R_LESS_JUMP:{
+            const uint8_t* next;
+            uint16_t offset;
+            if(op == OP_LESS_JUMP_IF_FALSE){
+                if(!popNumber(b) || !popNumber(a)) return false;
+                next = ip + 3;
+                offset = (ip[1] << 8) | ip[2];
+            }else{
+                if(!readRegister(ip[1], a) || !readRegister(ip[2], b)) return false;
+                if(a.kind != TraceValue::NUMBER || b.kind != TraceValue::NUMBER) return false;
+                next = ip + 5;
+                offset = (ip[3] << 8) | ip[4];
+            }
+            TraceValue condition = compare(COMPARE_LESS, a, b);
+            if(!guard(condition, condition.boolean ? next + offset : next)) return false;
+            ip = condition.boolean ? next : next + offset;
+            return true;
+        }
+        case OP_R_ADD:
+        case OP_R_SUBTRACT:
+        case OP_R_MULTIPLY:
+        case OP_R_DIVIDE:
+        case OP_R_LESS:
+        case OP_R_GREATER:{
+            if(!readRegister(ip[2], a) || !readRegister(ip[3], b)) return false;
+            if(a.kind != TraceValue::NUMBER || b.kind != TraceValue::NUMBER) return false;
+            if(op == OP_R_LESS || op == OP_R_GREATER){
+                result = compare(op == OP_R_LESS ? COMPARE_LESS : COMPARE_GREATER, a, b);
+            }else{
+                result = arithmetic(op == OP_R_SUBTRACT ? SSE_SUB : op == OP_R_MULTIPLY ? SSE_MUL
+                    : op == OP_R_DIVIDE ? SSE_DIV : SSE_ADD, a, b);
+            }
+            if(!writeRegister(ip[1], result)) return false;
+            ip += 4;
+            return true;
+        }
+        case OP_R_MOVE:
+            if(!readRegister(ip[2], a) || !writeRegister(ip[1], a)) return false;
+            ip += 3;
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool TraceRecorder::record(){
+    Chunk* chunk = frame->closure->function->chunk.get();
+    const uint8_t* code = chunk->getCode();
+    std::vector<bool> visited(chunk->getCodeSize(), false);
+    for(int length = 0; length < TRACE_MAX_LENGTH; length++){
+        visited[ip - code] = true;
+        low = std::min(low, ip);
+        high = std::max(high, ip);
+        if(*ip == OP_LOOP){
+            // a for loop jumps back twice, from the body to the increment
+            // and from there to the condition, but a jump back to anything
+            // already recorded is an inner loop
+            ip += 3 - ((ip[1] << 8) | ip[2]);
+            if(ip != header){
+                if(visited[ip - code]) return false;
+                continue;
+            }
+            if(!stack.empty()) return false;
+            // the collector gets its safepoint at the header
+            exits.push_back(TraceExit{header, {}});
+            return true;
+        }
+        if(!instruction()) return false;
+    }
+    return false;
+}
+
+// Compiles a recorded trace. Only the scratch registers are used, so the
+// code needs no prologue and returns straight from each exit.
+class TraceAssembler : public X64Assembler{
+    public:
+        TraceAssembler(TraceRecorder& trace, const GcPhase* phase)
+        : trace(trace), phase(phase){}
+        bool assemble(JitCode* jit);
+    private:
+        bool allocate();
+        void instruction(const TraceOp& op);
+        void guard(const TraceOp& op);
+        void exit(const TraceExit& exit);
+        void moveXmm(int dst, int src){ if(dst != src) sseRegisters(0x66, 0x28, dst, src); }
+        void compareXmm(int a, int b){ sseRegisters(0x66, 0x2e, a, b); }
+
+        Location local(int index){ return Location{RDI, index * VALUE_SIZE}; }
+        Location entry(int index){ return Location{RSI, index * VALUE_SIZE}; }
+
+        TraceRecorder& trace;
+        const GcPhase* phase;
+        // xmm register of each local of the frame the trace uses
+        std::vector<int> pinned;
+        // xmm register of each trace value
+        std::vector<int> registers;
+};
+
+// Gives each local its own register and each value a register from its
+// definition to its last use, which may be an exit that boxes it.
+bool TraceAssembler::allocate(){
+    if(trace.locals.size() >= TRACE_REGISTERS) return false;
+    pinned.assign(trace.written.size(), -1);
+    int next = 1;
+    for(int index : trace.locals) pinned[index] = next++;
+    std::vector<int> available;
+    for(int xmm = TRACE_REGISTERS; xmm >= next; xmm--) available.push_back(xmm);
+
+    std::vector<int> lastUse(trace.values, -1);
+    for(size_t i = 0; i < trace.ops.size(); i++){
+        const TraceOp& op = trace.ops[i];
+        if(op.dst >= 0) lastUse[op.dst] = i;
+        if(op.a >= 0) lastUse[op.a] = i;
+        if(op.b >= 0) lastUse[op.b] = i;
+        if(op.type == TRACE_GUARD){
+            for(const TraceValue& val : trace.exits[op.exit].stack){
+                if(val.kind == TraceValue::NUMBER) lastUse[val.id] = i;
+            }
+        }
+    }
+    std::vector<std::vector<int>> dying(trace.ops.size());
+    for(int id = 0; id < trace.values; id++) dying[lastUse[id]].push_back(id);
+
+    registers.assign(trace.values, -1);
+    for(size_t i = 0; i < trace.ops.size(); i++){
+        // operands stay live until the result has its register, so
+        // that writing the result never clobbers them
+        if(trace.ops[i].dst >= 0){
+            if(available.empty()) return false;
+            registers[trace.ops[i].dst] = available.back();
+            available.pop_back();
+        }
+        for(int id : dying[i]) available.push_back(registers[id]);
+    }
+    return true;
+}
+
+void TraceAssembler::instruction(const TraceOp& op){
+    switch(op.type){
+        case TRACE_CONSTANT:{
+            uint64_t bits;
+            memcpy(&bits, &op.number, sizeof(bits));
+            moveImmediate(RAX, bits);
+            moveToXmm(registers[op.dst], RAX);
+            break;
+        }
+        case TRACE_GET:
+            moveXmm(registers[op.dst], pinned[op.local]);
+            break;
+        case TRACE_SET:
+            moveXmm(pinned[op.local], registers[op.a]);
+            break;
+        case TRACE_ARITHMETIC:
+            moveXmm(registers[op.dst], registers[op.a]);
+            sseRegisters(0xf2, op.sse, registers[op.dst], registers[op.b]);
+            break;
+        case TRACE_NEGATE:
+            // flips the sign bit with xorpd
+            moveImmediate(RAX, 0x8000000000000000ull);
+            moveToXmm(0, RAX);
+            moveXmm(registers[op.dst], registers[op.a]);
+            sseRegisters(0x66, 0x57, registers[op.dst], 0);
+            break;
+        case TRACE_GUARD:
+            guard(op);
+            break;
+    }
+}
+
+// ucomisd sets CF for below, ZF for equal and all of CF, ZF and PF when
+// either operand is NaN.
+void TraceAssembler::guard(const TraceOp& op){
+    int a = registers[op.a];
+    int b = registers[op.b];
+    int fail = trace.exits[op.exit].label;
+    switch(op.compare){
+        case COMPARE_LESS:
+            compareXmm(b, a);
+            jumpIf(CC_BE, fail);
+            break;
+        case COMPARE_GREATER_EQUAL:
+            compareXmm(b, a);
+            jumpIf(CC_A, fail);
+            break;
+        case COMPARE_GREATER:
+            compareXmm(a, b);
+            jumpIf(CC_BE, fail);
+            break;
+        case COMPARE_LESS_EQUAL:
+            compareXmm(a, b);
+            jumpIf(CC_A, fail);
+            break;
+        case COMPARE_EQUAL:
+            compareXmm(a, b);
+            jumpIf(CC_P, fail);
+            jumpIf(CC_NE, fail);
+            break;
+        case COMPARE_NOT_EQUAL:{
+            int holds = newLabel();
+            compareXmm(a, b);
+            jumpIf(CC_P, holds);
+            jumpIf(CC_E, fail);
+            bind(holds);
+            break;
+        }
+    }
+}
+
+void TraceAssembler::exit(const TraceExit& exit){
+    bind(exit.label);
+    for(int index : trace.locals){
+        if(trace.written[index]) storeNumber(local(index), pinned[index]);
+    }
+    for(size_t i = 0; i < exit.stack.size(); i++){
+        const TraceValue& val = exit.stack[i];
+        if(val.kind == TraceValue::NUMBER){
+            storeNumber(entry(i), registers[val.id]);
+        }else{
+            storeValue(entry(i), BOOL_VAL(val.boolean));
+        }
+    }
+    moveImmediate(RAX, (uint64_t)exit.resume);
+    store(RDX, offsetof(CallFrame, ip), RAX);
+    loadAddress(RAX, RSI, exit.stack.size() * VALUE_SIZE);
+    ret();
+}
+
+bool TraceAssembler::assemble(JitCode* jit){
+    if(!allocate()) return false;
+    for(TraceExit& exit : trace.exits) exit.label = newLabel();
+
+    // a local holding something else than a number leaves the loop to the
+    // interpreter before anything was done
+    int bail = newLabel();
+    for(int index : trace.locals){
+        checkNumber(local(index), bail);
+        loadNumber(local(index), pinned[index]);
+    }
+    int loop = newLabel();
+    bind(loop);
+    for(const TraceOp& op : trace.ops) instruction(op);
+    moveImmediate(RAX, (uint64_t)phase);
+    compareDword(RAX, 0, GC_IDLE);
+    jumpIf(CC_E, loop);
+    jump(trace.exits.back().label);
+
+    bind(bail);
+    move(RAX, RSI);
+    ret();
+    for(const TraceExit& exit : trace.exits) this->exit(exit);
+
+    return install(jit);
+}
+
+#endif
+
+bool Tracer::record(VirtualMachine* vm, CallFrame* frame, value_t* sp, Trace* trace){
+#ifdef JIT_X64
+    TraceRecorder recorder(frame, sp);
+    if(!recorder.record()) return false;
+    auto code = std::make_unique<JitCode>();
+    TraceAssembler assembler(recorder, &vm->gc.phase);
+    if(!assembler.assemble(code.get())) return false;
+    trace->code = std::move(code);
+    trace->low = recorder.low;
+    trace->high = recorder.high;
+    return true;
+#else
+    return false;
+#endif
+}
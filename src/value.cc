@@ -3,7 +3,7 @@
 #include "object.hpp"
 
 
-uint8_t Value::addConstant(value_t value){
+int Value::addConstant(value_t value){
     value_stack.push_back(value);
     return value_stack.size() - 1;
 }
@@ -13,23 +13,29 @@ value_t Value::getElement(int index){
 }
 
 void Value::printValue(value_t val){
-    switch(val.type){
-        case VAL_BOOL:{
-            std::string is_ = AS_BOOL(val) ? "true" : "false";
-            std::cout << is_;
-            break;}
-        case VAL_NIL:{
-            std::cout << "nil";
-            break;}
-        case VAL_NUMBER:{
-            std::cout << AS_NUMBER(val);
-            break;}
-        case VAL_OBJ:{
-            Object::printObject(val);
-            break;}
+    if(IS_BOOL(val)){
+        std::string is_ = AS_BOOL(val) ? "true" : "false";
+        std::cout << is_;
+    }else if(IS_NIL(val)){
+        std::cout << "nil";
+    }else if(IS_NUMBER(val)){
+        std::cout << AS_NUMBER(val);
+    }else if(IS_OBJ(val)){
+        Object::printObject(val);
     }
 }
 
+#ifdef NAN_BOXING
+
+bool Value::valuesEqual(value_t a, value_t b){
+    if(IS_NUMBER(a) && IS_NUMBER(b)){
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    return a == b;
+}
+
+#else
+
 bool Value::valuesEqual(value_t a, value_t b){
     if(a.type != b.type) return false;
     switch(a.type){
@@ -39,12 +45,11 @@ bool Value::valuesEqual(value_t a, value_t b){
             return true;
         case VAL_NUMBER:{
             return AS_NUMBER(a) == AS_NUMBER(b);}
-        case VAL_OBJ: {
-            ObjString* aString = AS_STRING(a);
-            ObjString* bString = AS_STRING(b);
-            return aString->strs == bString->strs;
-            }
+        case VAL_OBJ:
+            return AS_OBJ(a) == AS_OBJ(b);
         default:
             return false;
     }
-}
\ No newline at end of file
+}
+
+#endif
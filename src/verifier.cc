@@ -0,0 +1,339 @@
+#include <vector>
+#include "verifier.hpp"
+
+static uint32_t readOperand(const uint8_t* code, int width){
+    uint32_t operand = 0;
+    for(int i = 0; i < width; i++) operand = (operand << 8) | code[i];
+    return operand;
+}
+
+static bool isJump(uint8_t op){
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP
+        || op == OP_LESS_JUMP_IF_FALSE || op == OP_R_LESS_JUMP;
+}
+
+// The offset of every jump is the last two bytes of the instruction and
+// counts from the instruction after it.
+static int jumpTarget(const uint8_t* code, int offset, int length){
+    int next = offset + length;
+    int distance = readOperand(code + next - 2, 2);
+    return code[offset] == OP_LOOP ? next - distance : next + distance;
+}
+
+static bool isConstant(Chunk* chunk, uint32_t index){
+    return index < (uint32_t)chunk->getValueSize();
+}
+
+static bool isStringConstant(Chunk* chunk, uint32_t index){
+    return isConstant(chunk, index) && IS_STRING(chunk->getValue(index));
+}
+
+static bool isRegister(Chunk* chunk, uint8_t operand){
+    return !(operand & REGISTER_CONSTANT) || isConstant(chunk, operand & ~REGISTER_CONSTANT);
+}
+
+// The length of the instruction at offset, or 0 if it does not fit in the
+// code or an operand that does not depend on the stack is out of range.
+static int checkOperands(ObjFunction* function, int offset, int globalCount){
+    Chunk* chunk = function->chunk.get();
+    const uint8_t* code = chunk->getCode();
+    int size = chunk->getCodeSize();
+    uint8_t op = code[offset];
+    if(op > OP_R_LESS_JUMP) return 0;
+
+    // the length of a closure depends on the function it names
+    if(op == OP_CLOSURE || op == OP_CLOSURE_LONG){
+        int width = op == OP_CLOSURE ? 1 : 3;
+        if(width >= size - offset) return 0;
+        uint32_t constant = readOperand(code + offset + 1, width);
+        if(!isConstant(chunk, constant) || !IS_FUNCTION(chunk->getValue(constant))) return 0;
+    }
+    int length = chunk->instructionLength(offset);
+    if(length > size - offset) return 0;
+
+    const uint8_t* operands = code + offset + 1;
+    switch(op){
+        case OP_CONSTANT:
+            return isConstant(chunk, operands[0]) ? length : 0;
+        case OP_CONSTANT_LONG:
+            return isConstant(chunk, readOperand(operands, 3)) ? length : 0;
+        case OP_ADD_LOCAL_CONSTANT:
+            return isConstant(chunk, operands[1]) ? length : 0;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+            return operands[0] < globalCount ? length : 0;
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+            return (int)readOperand(operands, 3) < globalCount ? length : 0;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            return operands[0] < function->upvalueCount ? length : 0;
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_GET_SUPER:
+            return isStringConstant(chunk, operands[0]) ? length : 0;
+        case OP_CLASS_LONG:
+        case OP_METHOD_LONG:
+        case OP_GET_SUPER_LONG:
+            return isStringConstant(chunk, readOperand(operands, 3)) ? length : 0;
+        // a name and a cache, with the argument count between them for
+        // invokes
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_THIS_PROPERTY:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            if(!isStringConstant(chunk, operands[0])) return 0;
+            return (int)readOperand(code + offset + length - 2, 2) < chunk->getCacheSize() ? length : 0;
+        case OP_GET_PROPERTY_LONG:
+        case OP_SET_PROPERTY_LONG:
+        case OP_INVOKE_LONG:
+        case OP_SUPER_INVOKE_LONG:
+            if(!isStringConstant(chunk, readOperand(operands, 3))) return 0;
+            return (int)readOperand(code + offset + length - 2, 2) < chunk->getCacheSize() ? length : 0;
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:
+            // captured locals are checked against the stack
+            for(int i = op == OP_CLOSURE ? 2 : 4; i < length; i += 2){
+                if(!code[offset+i] && code[offset+i+1] >= function->upvalueCount) return 0;
+            }
+            return length;
+        case OP_R_ADD:
+        case OP_R_SUBTRACT:
+        case OP_R_MULTIPLY:
+        case OP_R_DIVIDE:
+        case OP_R_LESS:
+        case OP_R_GREATER:
+            return isRegister(chunk, operands[1]) && isRegister(chunk, operands[2]) ? length : 0;
+        case OP_R_MOVE:
+            return isRegister(chunk, operands[1]) ? length : 0;
+        case OP_R_LESS_JUMP:
+            return isRegister(chunk, operands[0]) && isRegister(chunk, operands[1]) ? length : 0;
+        default:
+            return length;
+    }
+}
+
+// Pops a register operand off depth if it names the stack. A slot has to
+// be below depth, constants were checked with the other operands.
+static bool readRegister(uint8_t operand, int* depth){
+    if(operand & REGISTER_CONSTANT) return true;
+    if(operand == REGISTER_STACK){
+        if(*depth < 2) return false;
+        (*depth)--;
+        return true;
+    }
+    return operand < *depth;
+}
+
+// The height of the stack after the instruction at offset, which finds it
+// at depth, or -1 if the instruction pops a value or names a local that
+// is not there. Values pushed only on the way, such as the operands of a
+// concatenation, raise peak.
+static int stackEffect(ObjFunction* function, int offset, int depth, int* peak){
+    Chunk* chunk = function->chunk.get();
+    const uint8_t* code = chunk->getCode();
+    const uint8_t* operands = code + offset + 1;
+    // values the instruction needs on top of slot 0, and how many it
+    // leaves in their place
+    int pops = 0;
+    int pushes = 0;
+    switch(code[offset]){
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_UPVALUE:
+        case OP_CLASS:
+        case OP_CLASS_LONG:
+        case OP_GET_THIS_PROPERTY:
+            pushes = 1;
+            break;
+        case OP_GET_LOCAL:
+            if(operands[0] >= depth) return -1;
+            pushes = 1;
+            break;
+        case OP_GET_LOCAL_LOCAL:
+            // the second local may be the value the first one pushed
+            if(operands[0] >= depth || operands[1] > depth) return -1;
+            pushes = 2;
+            break;
+        case OP_ADD_LOCAL_CONSTANT:
+            if(operands[0] >= depth) return -1;
+            // anything but two numbers pushes both for OP_ADD
+            if(depth + 2 > *peak) *peak = depth + 2;
+            pushes = 1;
+            break;
+        case OP_SET_LOCAL:
+            if(operands[0] >= depth) return -1;
+            pops = pushes = 1;
+            break;
+        case OP_SET_LOCAL_POP:
+            if(operands[0] >= depth) return -1;
+            pops = 1;
+            break;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+            pops = 1;
+            break;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+        case OP_SET_UPVALUE:
+        case OP_GET_PROPERTY:
+        case OP_GET_PROPERTY_LONG:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_JUMP_IF_FALSE:
+            pops = pushes = 1;
+            break;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_LESS_NUM:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_LONG:
+        case OP_METHOD:
+        case OP_METHOD_LONG:
+        case OP_INHERIT:
+        case OP_GET_SUPER:
+        case OP_GET_SUPER_LONG:
+            pops = 2;
+            pushes = 1;
+            break;
+        case OP_LESS_JUMP_IF_FALSE:
+            pops = 2;
+            break;
+        case OP_CALL:
+            pops = operands[0] + 1;
+            pushes = 1;
+            break;
+        case OP_INVOKE:
+            pops = operands[1] + 1;
+            pushes = 1;
+            break;
+        case OP_INVOKE_LONG:
+            pops = operands[3] + 1;
+            pushes = 1;
+            break;
+        // the superclass sits above the receiver and the arguments
+        case OP_SUPER_INVOKE:
+            pops = operands[1] + 2;
+            pushes = 1;
+            break;
+        case OP_SUPER_INVOKE_LONG:
+            pops = operands[3] + 2;
+            pushes = 1;
+            break;
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:{
+            // the closure is pushed before capturing, so a local function
+            // can capture the slot it goes into
+            int length = chunk->instructionLength(offset);
+            for(int i = code[offset] == OP_CLOSURE ? 2 : 4; i < length; i += 2){
+                if(code[offset+i] && code[offset+i+1] > depth) return -1;
+            }
+            pushes = 1;
+            break;
+        }
+        case OP_RETURN:
+            pops = 1;
+            break;
+        case OP_R_ADD:
+        case OP_R_SUBTRACT:
+        case OP_R_MULTIPLY:
+        case OP_R_DIVIDE:
+        case OP_R_LESS:
+        case OP_R_GREATER:
+            if(!readRegister(operands[1], &depth) || !readRegister(operands[2], &depth)) return -1;
+            // strings are concatenated on the stack
+            if(depth + 2 > *peak) *peak = depth + 2;
+            if(operands[0] == 0) pushes = 1;
+            else if(operands[0] >= depth) return -1;
+            break;
+        case OP_R_MOVE:
+            if(!readRegister(operands[1], &depth) || operands[0] >= depth) return -1;
+            break;
+        case OP_R_LESS_JUMP:
+            if(!readRegister(operands[0], &depth) || !readRegister(operands[1], &depth)) return -1;
+            break;
+        default:
+            break;
+    }
+    if(depth - pops < 1) return -1;
+    depth += pushes - pops;
+    if(depth > *peak) *peak = depth;
+    return depth;
+}
+
+int verifyFunction(ObjFunction* function, int globalCount){
+    Chunk* chunk = function->chunk.get();
+    const uint8_t* code = chunk->getCode();
+    int size = chunk->getCodeSize();
+
+    // the length of the instruction starting at each offset, 0 inside
+    // operands
+    std::vector<int> lengths(size, 0);
+    for(int offset = 0; offset < size;){
+        int length = checkOperands(function, offset, globalCount);
+        if(length == 0) return -1;
+        lengths[offset] = length;
+        offset += length;
+    }
+    for(int offset = 0; offset < size; offset += lengths[offset]){
+        if(!isJump(code[offset])) continue;
+        int target = jumpTarget(code, offset, lengths[offset]);
+        if(target < 0 || target >= size || lengths[target] == 0) return -1;
+    }
+
+    // the height each instruction finds the stack at, -1 until a path
+    // reaches it
+    std::vector<int> depths(size, -1);
+    std::vector<int> pending;
+    int peak = function->arity + 1;
+    if(size == 0) return -1;
+    depths[0] = peak;
+    pending.push_back(0);
+    while(!pending.empty()){
+        int offset = pending.back();
+        pending.pop_back();
+        int depth = stackEffect(function, offset, depths[offset], &peak);
+        if(depth < 0) return -1;
+
+        uint8_t op = code[offset];
+        int next = offset + lengths[offset];
+        int successors[2];
+        int count = 0;
+        if(op != OP_JUMP && op != OP_LOOP && op != OP_RETURN){
+            if(next >= size) return -1;
+            successors[count++] = next;
+        }
+        if(isJump(op)) successors[count++] = jumpTarget(code, offset, lengths[offset]);
+        for(int i = 0; i < count; i++){
+            int successor = successors[i];
+            if(depths[successor] == -1){
+                depths[successor] = depth;
+                pending.push_back(successor);
+            }else if(depths[successor] != depth){
+                return -1;
+            }
+        }
+    }
+    return peak;
+}
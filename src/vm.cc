@@ -1,18 +1,10 @@
 #include "vm.hpp"
+#include "aot.hpp"
 #include <iostream>
+#include <iomanip>
+#include <algorithm>
 
 
-#define BINARY_OP(valueType, op) \
-    do { \
-      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-        runtimeError("Operands must be numbers."); \
-        return INTERPRET_RUNTIME_ERROR; \
-      } \
-      double b = AS_NUMBER(stack_pop()); \
-      double a = AS_NUMBER(stack_pop()); \
-      stack_push(valueType(a op b)); \
-    } while (false)
-
 void VirtualMachine::stack_push(value_t val){
     *stack_ptr = val;
     (stack_ptr)++;
@@ -31,27 +23,33 @@ bool VirtualMachine::isFalsey(value_t val){
     return IS_NIL(val) || (IS_BOOL(val) && !AS_BOOL(val));
 }
 
+bool VirtualMachine::callNative(ObjNative* native, int argCount){
+    if(native->arity != argCount && native->arity != NATIVE_ANY_ARITY){
+        runtimeError("Expected " + std::to_string(native->arity) +
+                     " arguments but got " + std::to_string(argCount));
+        return false;
+    }
+    value_t result = native->function(this, argCount, &*(stack_ptr - argCount));
+    stack_ptr -= argCount;
+    stack_ptr[-1] = result;
+    return true;
+}
+
 bool VirtualMachine::callValue(value_t callee, int argCount){
     if (IS_OBJ(callee)){
         switch(OBJ_TYPE(callee)){
             case OBJ_CLOSURE:
                 return call(AS_CLOSURE(callee), argCount);
-            case OBJ_NATIVE:{
-                NativeFn native = AS_NATIVE(callee);
-                value_t result = native(argCount, stack_ptr - argCount);
-                stack_ptr -= argCount + 1;
-                stack_push(result);
-                return true;
-            }
+            case OBJ_NATIVE:
+                return callNative(AS_NATIVE(callee), argCount);
             case OBJ_CLASS:{
                 // instantiate class
                 // if there is init method, call it first
                 ObjClass* klass = AS_CLASS(callee);
-                stack_ptr[-argCount -1] = OBJ_VAL(new ObjInstance(klass));
-                if(!(klass->methods.find("init") == klass->methods.end())){
-                    value_t initializer;
-                    initializer = klass->methods["init"];
-                    call(AS_CLOSURE(initializer), argCount);
+                stack_ptr[-argCount -1] = OBJ_VAL(gc.allocateObject<ObjInstance>(klass, shapes.getRoot()));
+                auto initializer = klass->methods.find(initString);
+                if(initializer != klass->methods.end()){
+                    call(AS_CLOSURE(initializer->second), argCount);
                 }else if(argCount != 0){
                     runtimeError("Expected 0 arguments but got some.");
                     return false;
@@ -84,7 +82,8 @@ ObjUpvalue* VirtualMachine::captureUpvalue(value_t* local){
         return upvalue;
     }
 
-    ObjUpvalue* createdUpvalue = new ObjUpvalue(local);
+    ObjUpvalue* createdUpvalue = gc.allocateObject<ObjUpvalue>(local);
+    createdUpvalue->next = upvalue;
 
     if(prevUpvalue == NULL){
         openUpvalues = createdUpvalue;
@@ -100,37 +99,36 @@ void VirtualMachine::closeUpvalues(value_t* last){
         ObjUpvalue* upvalue = openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        gc.writeBarrier((Obj*)upvalue, upvalue->closed);
         openUpvalues = upvalue->next;
     }
 }
 
 void VirtualMachine::defineNative(
-    std::string name, NativeFn function){
-    ObjString* strObj = new ObjString;
-    // strObj->strs = name;
-    // strObj->length = name.end() - name.begin();
-    // stack_push(OBJ_VAL(strObj));
-
-    ObjNative* native = new ObjNative(function);
-    // stack_push(OBJ_VAL(native));
-
-    globals_table[name] = OBJ_VAL(native);
+    std::string name, NativeFn function, int arity){
+    int slot = globals.resolve(gc.copyString(name));
+    gc.writeBarrier(&globals, slot);
+    ObjNative* native = gc.allocateObject<ObjNative>(function, arity);
+    globals.values[slot] = OBJ_VAL(native);
+    gc.writeBarrier(&globals, slot);
 }
 
 void VirtualMachine::defineMethod(ObjString* name){
     value_t method = peek(0);
     ObjClass* klass = AS_CLASS(peek(1));
-    klass->methods[name->strs] = method;
+    klass->methods[name] = method;
+    gc.writeBarrier((Obj*)klass, OBJ_VAL(name));
+    gc.writeBarrier((Obj*)klass, method);
     stack_pop();
 }
 
 bool VirtualMachine::bindMethod(ObjClass* klass, ObjString* name){
-    if(klass->methods.find(name->strs) == klass->methods.end()){
+    auto method = klass->methods.find(name);
+    if(method == klass->methods.end()){
         runtimeError("Undefined proprety.");
         return false;
     }
-    value_t method = klass->methods[name->strs];
-    ObjBoundMethod* bound = new ObjBoundMethod(peek(0), AS_CLOSURE(method));
+    ObjBoundMethod* bound = gc.allocateObject<ObjBoundMethod>(peek(0), AS_CLOSURE(method->second));
     stack_pop();
     stack_push(OBJ_VAL(bound));
     return true;
@@ -144,30 +142,88 @@ bool VirtualMachine::call(ObjClosure* closure, int argCount){
         return false;
     }
 
-    if(frameCount == FRAMES_MAX){
+    if(frameCount == (int)stackConfig.maxFrames){
         runtimeError("Stack overflow");
         return false;
     }
+    if(frameCount == (int)frames.size()) frames.resize(frames.size() * 2);
+    // the frame starts at the callee, below the arguments
+    int needed = closure->function->stackSize - argCount - 1;
+    if(stack_memory->end() - stack_ptr < needed) growStack(needed);
+
+    ObjFunction* function = closure->function;
+    if(jitConfig.enabled && function->jit == NULL && ++function->calls == jitConfig.threshold){
+        Jit::compile(this, function);
+    }
 
     CallFrame* frame = &frames[frameCount++];
     frame->closure = closure;
-    frame->ip = closure->function->chunk->getChunk()->begin();
+    frame->ip = closure->function->chunk->getCode();
     frame->slots = stack_ptr - argCount; // stack_ptr is pointer at top of stack
     return true;
 }
 
+void VirtualMachine::growStack(size_t needed){
+    size_t size = stack_memory->size();
+    size_t used = stack_ptr - stack_memory->begin();
+    while(size - used < needed) size *= 2;
+    auto grown = std::make_unique<stack_array>(size);
+    std::copy(stack_memory->begin(), stack_ptr, grown->begin());
+
+    value_t* from = stack_memory->data();
+    value_t* to = grown->data();
+    for(int i = 0; i < frameCount; i++){
+        frames[i].slots = grown->begin() + (frames[i].slots - stack_memory->begin());
+    }
+    for(ObjUpvalue* upvalue = openUpvalues; upvalue != NULL; upvalue = upvalue->next){
+        upvalue->location = to + (upvalue->location - from);
+    }
+    stack_ptr = grown->begin() + used;
+    stack_memory = std::move(grown);
+}
+
+// Counts a lookup the cache could not answer and returns the entry to
+// record its result in, or NULL when the site no longer caches.
+CacheEntry* VirtualMachine::cacheMiss(InlineCache* cache){
+    if(cache->megamorphic){
+        cacheStats.megamorphic++;
+        return NULL;
+    }
+    cacheStats.misses++;
+    return cache->add();
+}
+
+void VirtualMachine::cacheMethod(CacheEntry* entry, Shape* shape,
+                                 ObjClass* klass, ObjClosure* method){
+    if(entry == NULL) return;
+    entry->shape = shape;
+    entry->klass = klass;
+    entry->method = method;
+    // the caches belong to the running function and keep both alive
+    Obj* function = (Obj*)frames[frameCount - 1].closure->function;
+    gc.writeBarrier(function, OBJ_VAL(klass));
+    gc.writeBarrier(function, OBJ_VAL(method));
+}
+
 bool VirtualMachine::invokeFromClass(ObjClass* klass, ObjString* name,
-                            int argCount) {
-    if (klass->methods.find(name->strs) == klass->methods.end()){
+                            int argCount, InlineCache* cache) {
+    CacheEntry* entry = cache->find(NULL, klass);
+    if(entry != NULL){
+        cacheStats.hits++;
+        return call(entry->method, argCount);
+    }
+    entry = cacheMiss(cache);
+
+    auto method = klass->methods.find(name);
+    if (method == klass->methods.end()){
         runtimeError("Undefined property.");
         return false;
     }
-
-    value_t method = klass->methods[name->strs];
-    return call(AS_CLOSURE(method), argCount);
+    cacheMethod(entry, NULL, klass, AS_CLOSURE(method->second));
+    return call(AS_CLOSURE(method->second), argCount);
 }
 
-bool VirtualMachine::invoke(ObjString* name, int argCount) {
+bool VirtualMachine::invoke(ObjString* name, int argCount, InlineCache* cache) {
     value_t receiver = peek(argCount);
 
     if (!IS_INSTANCE(receiver)) {
@@ -177,42 +233,163 @@ bool VirtualMachine::invoke(ObjString* name, int argCount) {
 
     ObjInstance* instance = AS_INSTANCE(receiver);
 
-    value_t value;
-    if (!(instance->fields.find(name->strs) == instance->fields.end())){
+    CacheEntry* entry = cache->find(instance->shape, instance->klass);
+    if(entry != NULL){
+        cacheStats.hits++;
+        if(entry->method != NULL) return call(entry->method, argCount);
+        value_t value = instance->fields[entry->slot];
+        stack_ptr[-argCount - 1] = value;
+        return callValue(value, argCount);
+    }
+    entry = cacheMiss(cache);
+
+    int slot = instance->shape->lookup(name);
+    if (slot >= 0){
+        if(entry != NULL){
+            entry->shape = instance->shape;
+            entry->slot = slot;
+        }
+        value_t value = instance->fields[slot];
         stack_ptr[-argCount - 1] = value;
         return callValue(value, argCount);
     }
 
-  return invokeFromClass(instance->klass, name, argCount);
+    auto method = instance->klass->methods.find(name);
+    if (method == instance->klass->methods.end()){
+        runtimeError("Undefined property.");
+        return false;
+    }
+    cacheMethod(entry, instance->shape, instance->klass, AS_CLOSURE(method->second));
+    return call(AS_CLOSURE(method->second), argCount);
+}
+
+void VirtualMachine::printCacheStats(std::ostream& out){
+    out << "[ic] hits: " << cacheStats.hits
+        << " misses: " << cacheStats.misses
+        << " megamorphic: " << cacheStats.megamorphic << std::endl;
+}
+
+// Lists the most executed pairs of adjacent instructions, the candidates
+// for new superinstructions. Pairs starting with a jump, call or return
+// are left out since their second instruction is not the next one in the
+// code.
+void VirtualMachine::printOpcodePairs(std::ostream& out, size_t limit){
+#ifdef OPCODE_PROFILE
+    struct Pair{
+        uint64_t count;
+        uint8_t first;
+        uint8_t second;
+    };
+    std::vector<Pair> pairs;
+    uint64_t total = 0;
+    for(int first = 0; first < UINT8_COUNT; first++){
+        for(int second = 0; second < UINT8_COUNT; second++){
+            uint64_t count = opcodeProfile->counts[first][second];
+            total += count;
+            switch(first){
+                case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_LOOP:
+                case OP_LESS_JUMP_IF_FALSE: case OP_CALL: case OP_RETURN:
+                case OP_INVOKE: case OP_INVOKE_LONG:
+                case OP_SUPER_INVOKE: case OP_SUPER_INVOKE_LONG:
+                    continue;
+            }
+            if(count > 0) pairs.push_back(Pair{count, (uint8_t)first, (uint8_t)second});
+        }
+    }
+    std::sort(pairs.begin(), pairs.end(),
+        [](const Pair& a, const Pair& b){ return a.count > b.count; });
+    out << "[pairs] " << total << " instructions executed" << std::endl;
+    for(size_t i = 0; i < pairs.size() && i < limit; i++){
+        out << "[pairs] " << std::left << std::setw(24) << get_op_code(pairs[i].first)
+            << std::setw(24) << get_op_code(pairs[i].second) << std::right
+            << std::setw(12) << pairs[i].count << "  "
+            << std::fixed << std::setprecision(1) << 100.0 * pairs[i].count / total << "%"
+            << std::endl;
+    }
+#else
+    out << "[pairs] not recorded, configure with -DLEVI_OPCODE_PROFILE=ON" << std::endl;
+#endif
 }
 
 void VirtualMachine::concatenate(){
     ObjString* b = AS_STRING(stack_pop());
     ObjString* a = AS_STRING(stack_pop());
-    int con_length = a->length + b->length;
-    std::string con_strs = a->strs + b->strs;
-    ObjString* c = new ObjString{OBJ_STRING, con_length, con_strs};
+    ObjString* c = gc.copyString(a->strs + b->strs);
     stack_push(OBJ_VAL(c));
 }
 
-InterpretResult VirtualMachine::interpret(std::string source){
-    Compiler compiler(source);
+ObjFunction* VirtualMachine::compile(std::string source){
+    Compiler compiler(source, &gc, &globals, registers);
     compiler.setCurrent(&compiler);
-    ObjFunction* function = compiler.compile(source);
+    return compiler.compile(source);
+}
+
+InterpretResult VirtualMachine::interpret(std::string source){
+    ObjFunction* function = compile(source);
+    if(function==NULL) return INTERPRET_COMPILE_ERROR;
+    return interpret(function);
+}
+
+// Runs the bytecode cached in cachePath if it was compiled from this
+// source, otherwise compiles the source and refreshes the cache.
+InterpretResult VirtualMachine::interpret(std::string source, std::string cachePath){
+    uint64_t sourceHash = LevcWriter::hashSource(source);
+    ObjFunction* function = NULL;
+    auto image = std::make_unique<LevcImage>();
+    if(image->open(cachePath)){
+        LevcReader reader(&gc, &globals);
+        function = reader.read(image.get(), sourceHash, registers ? LEVC_REGISTERS : 0);
+    }
+    if(function != NULL){
+        images.push_back(std::move(image));
+    }else{
+        function = compile(source);
+        if(function==NULL) return INTERPRET_COMPILE_ERROR;
+        LevcWriter writer(&globals);
+        writer.write(cachePath, sourceHash, registers ? LEVC_REGISTERS : 0, function);
+    }
+    return interpret(function);
+}
+
+InterpretResult VirtualMachine::interpret(std::string source, const AotModule* module){
+    ObjFunction* function = compile(source);
     if(function==NULL) return INTERPRET_COMPILE_ERROR;
+    if(!Aot::attach(function, module)){
+        std::cerr << "Translated code is out of date, running the script in the interpreter." << std::endl;
+    }
+    return interpret(function);
+}
 
-    ObjClosure* closure = new ObjClosure(function);
+bool VirtualMachine::translate(std::string source, std::string path){
+    ObjFunction* function = compile(source);
+    if(function==NULL) return false;
+    AotWriter writer;
+    return writer.write(path, source, registers ? LEVC_REGISTERS : 0, function);
+}
+
+InterpretResult VirtualMachine::interpret(ObjFunction* function){
+    stack_push(OBJ_VAL(function));
+    ObjClosure* closure = gc.allocateObject<ObjClosure>(function);
+    stack_pop();
     stack_push(OBJ_VAL(closure));
     call(closure, 0);
 
-    return run();
+    InterpretResult result = run();
+    output.flush();
+    return result;
 }
 
 void VirtualMachine::runtimeError(std::string format){
+    output.flush();
     std::cout << "Traceback (most recent call last):" << std::endl;
     for(int i = 0; i < frameCount; i++){
+        if(i == TRACEBACK_CALLS && frameCount > 2 * TRACEBACK_CALLS){
+            std::cout << "  ... " << frameCount - 2 * TRACEBACK_CALLS << " more calls" << std::endl;
+            i = frameCount - TRACEBACK_CALLS - 1;
+            continue;
+        }
         CallFrame* frame = &frames[i];
-        uint8_t offset = frame->ip - frame->closure->function->chunk->getChunk()->begin();
+        int offset = frame->ip - frame->closure->function->chunk->getCode() - 1;
         int line = frame->closure->function->chunk->getLine(offset);
         std::cout << "  line " << line << ", in ";
         if (frame->closure->function->name == ""){
@@ -224,19 +401,194 @@ void VirtualMachine::runtimeError(std::string format){
     std::cerr << "RuntimeError: " << format << std::endl;
 }
 
+// Threaded dispatch jumps straight from one handler to the next through a
+// table of label addresses. It needs the GCC/Clang labels-as-values
+// extension, and tracing keeps the switch so that it prints from one place.
+#if defined(__GNUC__) && !defined(DEBUG_TRACE_EXECUTION) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
 InterpretResult VirtualMachine::run(){
-    CallFrame* frame = &frames[frameCount - 1];
-    auto read_byte = [&](){chunk_iter ret_ip = frame->ip; frame->ip += 1; return *ret_ip;};
-    auto read_short = [&](){frame->ip += 2; return (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]);};
+    CallFrame* frame;
+    const uint8_t* ip;
+    stack_iter sp;
+    value_t* constants;
+    // constant or global index of the current instruction, read by the
+    // handlers that have a _LONG variant
+    uint32_t operand;
+    // false while running code mapped from a .levc image, which is never
+    // quickened
+    bool writable;
+    // whether the frame's function has been compiled to machine code or
+    // translated ahead of time
+    bool jitted;
+
+// While an instruction runs the locals above are the only up to date copy
+// of the frame's ip and of the stack top. Anything that can look at them
+// from outside (calls, allocation, errors) must store them first.
+#define STORE_FRAME() do{ frame->ip = ip; stack_ptr = sp; }while(false)
+#define LOAD_FRAME() \
+    do{ \
+        frame = &frames[frameCount - 1]; \
+        ip = frame->ip; \
+        sp = stack_ptr; \
+        constants = frame->closure->function->chunk->getValues(); \
+        writable = !frame->closure->function->chunk->isMapped(); \
+        jitted = frame->closure->function->jit != NULL || frame->closure->function->aot != NULL; \
+    }while(false)
+// Loads the frame now on top and continues it in machine code if its
+// function has been compiled.
+#define ENTER_FRAME() \
+    do{ \
+        LOAD_FRAME(); \
+        if(jitted) goto run_jit; \
+    }while(false)
+// Rewrites the opcode of the instruction being executed.
+#define QUICKEN(op) do{ if(writable) ((uint8_t*)ip)[-1] = (op); }while(false)
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_LONG() (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define OPERAND_STRING() AS_STRING(constants[operand])
+#define PUSH(val) (*sp++ = (val))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+#define RUNTIME_ERROR(message) \
+    do{ \
+        STORE_FRAME(); \
+        runtimeError(message); \
+        return INTERPRET_RUNTIME_ERROR; \
+    }while(false)
+#define BINARY_OP(valueType, op) \
+    do{ \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        double b = AS_NUMBER(POP()); \
+        double a = AS_NUMBER(POP()); \
+        PUSH(valueType(a op b)); \
+    }while(false)
+// Reads a register operand, see REGISTER_CONSTANT. Slot 0 lies below
+// slots, so the index has to be signed.
+#define READ_REGISTER() \
+    (operand = READ_BYTE(), \
+     operand & REGISTER_CONSTANT ? constants[operand & ~REGISTER_CONSTANT] \
+     : operand == REGISTER_STACK ? POP() : frame->slots[(int)operand-1])
+#define WRITE_REGISTER(dst, val) \
+    do{ \
+        if((dst) == 0) PUSH(val); \
+        else frame->slots[(dst)-1] = (val); \
+    }while(false)
+#define REGISTER_OP(valueType, op) \
+    do{ \
+        uint8_t dst = READ_BYTE(); \
+        value_t a = READ_REGISTER(); \
+        value_t b = READ_REGISTER(); \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        WRITE_REGISTER(dst, valueType(AS_NUMBER(a) op AS_NUMBER(b))); \
+    }while(false)
+
+#ifdef COMPUTED_GOTO
+    // one entry per OpCode, in the same order
+    static void* dispatchTable[] = {
+        &&label_OP_CONSTANT,
+        &&label_OP_NIL,
+        &&label_OP_TRUE,
+        &&label_OP_FALSE,
+        &&label_OP_POP,
+        &&label_OP_GET_LOCAL,
+        &&label_OP_SET_LOCAL,
+        &&label_OP_GET_GLOBAL,
+        &&label_OP_DEFINE_GLOBAL,
+        &&label_OP_SET_GLOBAL,
+        &&label_OP_GET_UPVALUE,
+        &&label_OP_SET_UPVALUE,
+        &&label_OP_GET_PROPERTY,
+        &&label_OP_SET_PROPERTY,
+        &&label_OP_EQUAL,
+        &&label_OP_GREATER,
+        &&label_OP_LESS,
+        &&label_OP_ADD,
+        &&label_OP_SUBTRACT,
+        &&label_OP_MULTIPLY,
+        &&label_OP_DIVIDE,
+        &&label_OP_NOT,
+        &&label_OP_NEGATE,
+        &&label_OP_PRINT,
+        &&label_OP_JUMP,
+        &&label_OP_JUMP_IF_FALSE,
+        &&label_OP_LOOP,
+        &&label_OP_CALL,
+        &&label_OP_INVOKE,
+        &&label_OP_SUPER_INVOKE,
+        &&label_OP_CLOSURE,
+        &&label_OP_CLOSE_UPVALUE,
+        &&label_OP_RETURN,
+        &&label_OP_CLASS,
+        &&label_OP_METHOD,
+        &&label_OP_INHERIT,
+        &&label_OP_GET_SUPER,
+        &&label_OP_CONSTANT_LONG,
+        &&label_OP_GET_GLOBAL_LONG,
+        &&label_OP_DEFINE_GLOBAL_LONG,
+        &&label_OP_SET_GLOBAL_LONG,
+        &&label_OP_GET_PROPERTY_LONG,
+        &&label_OP_SET_PROPERTY_LONG,
+        &&label_OP_INVOKE_LONG,
+        &&label_OP_SUPER_INVOKE_LONG,
+        &&label_OP_CLOSURE_LONG,
+        &&label_OP_CLASS_LONG,
+        &&label_OP_METHOD_LONG,
+        &&label_OP_GET_SUPER_LONG,
+        &&label_OP_NOT_EQUAL,
+        &&label_OP_GREATER_EQUAL,
+        &&label_OP_LESS_EQUAL,
+        &&label_OP_SET_LOCAL_POP,
+        &&label_OP_GET_LOCAL_LOCAL,
+        &&label_OP_ADD_LOCAL_CONSTANT,
+        &&label_OP_LESS_JUMP_IF_FALSE,
+        &&label_OP_GET_THIS_PROPERTY,
+        &&label_OP_ADD_NUM,
+        &&label_OP_ADD_STR,
+        &&label_OP_LESS_NUM,
+        &&label_OP_R_ADD,
+        &&label_OP_R_SUBTRACT,
+        &&label_OP_R_MULTIPLY,
+        &&label_OP_R_DIVIDE,
+        &&label_OP_R_LESS,
+        &&label_OP_R_GREATER,
+        &&label_OP_R_MOVE,
+        &&label_OP_R_LESS_JUMP,
+    };
+    static_assert(sizeof(dispatchTable) / sizeof(void*) == OP_R_LESS_JUMP + 1,
+                  "dispatchTable must cover every OpCode");
+#define CASE(op) label_##op
+#ifdef OPCODE_PROFILE
+#define NEXT do{ opcodeProfile->record(*ip); goto *dispatchTable[READ_BYTE()]; }while(false)
+#else
+#define NEXT goto *dispatchTable[READ_BYTE()]
+#endif
+#else
+#define CASE(op) case op
+#define NEXT break
+#endif
+
+    ENTER_FRAME();
+#ifdef COMPUTED_GOTO
+    NEXT;
+#else
     for(;;){
         #ifdef DEBUG_TRACE_EXECUTION
+            output.flush();
             std::cout << std::endl;
-            for(stack_iter slot = stack_memory->begin(); slot != stack_ptr; slot++){
-                if (slot->type == VAL_BOOL){
+            for(stack_iter slot = stack_memory->begin(); slot != sp; slot++){
+                if (IS_BOOL(*slot)){
                     std::cout << "[" << AS_BOOL(*slot) << "]" << std::endl;
-                }else if (slot->type == VAL_NIL){
+                }else if (IS_NIL(*slot)){
                     std::cout << "[Nil]" << std::endl;
-                }else if (slot->type == VAL_NUMBER){
+                }else if (IS_NUMBER(*slot)){
                     std::cout << "[" << AS_NUMBER(*slot) << "]" << std::endl;
                 }else if (IS_STRING(*slot)){
                     std::cout << "String: " << "[" << AS_CSTRING(*slot) << "]" << std::endl;
@@ -252,248 +604,574 @@ InterpretResult VirtualMachine::run(){
                     std::cout << "UNKONWN OBJECT" << std::endl;
                 }
             }
-            std::cout << get_op_code(*frame->ip) << " :" << frame->closure->function->name << std::endl;
+            std::cout << get_op_code(*ip) << " :" << frame->closure->function->name << std::endl;
         #endif
-        
-        uint8_t instruction;
-        switch (instruction = read_byte()){
-            case OP_CONSTANT:{
-                value_t constant = frame->closure->function->chunk->getValue(read_byte());
-                stack_push(constant);
-                break;
+
+        #ifdef OPCODE_PROFILE
+            opcodeProfile->record(*ip);
+        #endif
+        switch (READ_BYTE()){
+#endif
+            CASE(OP_CONSTANT):{
+                PUSH(READ_CONSTANT());
+                NEXT;
             }
-            case OP_NIL: stack_push(NIL_VAL); break;
-            case OP_TRUE: stack_push(BOOL_VAL(true)); break;
-            case OP_FALSE: stack_push(BOOL_VAL(false)); break;
-            case OP_POP: stack_pop(); break;
-            case OP_GET_LOCAL:{
-                uint8_t slot = read_byte();
-                stack_push(frame->slots[slot-1]);
-                break;
+            CASE(OP_CONSTANT_LONG):{
+                PUSH(constants[READ_LONG()]);
+                NEXT;
             }
-            case OP_SET_LOCAL:{
-                uint8_t slot = read_byte();
-                frame->slots[slot] = peek(0);
-                break;
+            CASE(OP_NIL): PUSH(NIL_VAL); NEXT;
+            CASE(OP_TRUE): PUSH(BOOL_VAL(true)); NEXT;
+            CASE(OP_FALSE): PUSH(BOOL_VAL(false)); NEXT;
+            CASE(OP_POP): POP(); NEXT;
+            CASE(OP_GET_LOCAL):{
+                uint8_t slot = READ_BYTE();
+                PUSH(frame->slots[slot-1]);
+                NEXT;
             }
-            case OP_GET_GLOBAL:{
-                ObjString* name = AS_STRING(frame->closure->function->chunk->getValue(read_byte()));
-                value_t val;
-                if (globals_table.find(name->strs) == globals_table.end()){
-                    std::string format = "Undifined variable " + name->strs + ".";
-                    runtimeError(format);
-                    return INTERPRET_RUNTIME_ERROR;
-                }else{
-                    val = globals_table[name->strs];
+            CASE(OP_SET_LOCAL):{
+                uint8_t slot = READ_BYTE();
+                frame->slots[slot-1] = PEEK(0);
+                NEXT;
+            }
+            CASE(OP_SET_LOCAL_POP):{
+                uint8_t slot = READ_BYTE();
+                frame->slots[slot-1] = POP();
+                NEXT;
+            }
+            CASE(OP_GET_LOCAL_LOCAL):{
+                uint8_t first = READ_BYTE();
+                uint8_t second = READ_BYTE();
+                PUSH(frame->slots[first-1]);
+                PUSH(frame->slots[second-1]);
+                NEXT;
+            }
+            CASE(OP_ADD_LOCAL_CONSTANT):{
+                value_t a = frame->slots[READ_BYTE()-1];
+                value_t b = READ_CONSTANT();
+                if(IS_NUMBER(a) && IS_NUMBER(b)){
+                    PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                    NEXT;
                 }
-                stack_push(val);
-                break;
+                PUSH(a);
+                PUSH(b);
+                goto do_add;
             }
-            case OP_DEFINE_GLOBAL:{
-                ObjString* name = AS_STRING(frame->closure->function->chunk->getValue(read_byte()));
-                globals_table[name->strs] = peek(0);
-                stack_pop();
-                break;
+            CASE(OP_GET_GLOBAL_LONG): operand = READ_LONG(); goto do_get_global;
+            CASE(OP_GET_GLOBAL): operand = READ_BYTE();
+            do_get_global:{
+                uint32_t slot = operand;
+                value_t val = globals.values[slot];
+                if (IS_UNDEFINED(val)){
+                    RUNTIME_ERROR("Undifined variable " + globals.names[slot]->strs + ".");
+                }
+                PUSH(val);
+                NEXT;
             }
-            case OP_SET_GLOBAL:{
-                ObjString* name = AS_STRING(frame->closure->function->chunk->getValue(read_byte()));
-                if (globals_table.find(name->strs) == globals_table.end()){
-                    std::string format = "Undifined variable " + name->strs + ".";
-                    runtimeError(format);
-                    return INTERPRET_RUNTIME_ERROR;
-                }else{
-                    globals_table[name->strs] = peek(0);
+            CASE(OP_DEFINE_GLOBAL_LONG): operand = READ_LONG(); goto do_define_global;
+            CASE(OP_DEFINE_GLOBAL): operand = READ_BYTE();
+            do_define_global:{
+                uint32_t slot = operand;
+                globals.values[slot] = PEEK(0);
+                gc.writeBarrier(&globals, slot);
+                POP();
+                NEXT;
+            }
+            CASE(OP_SET_GLOBAL_LONG): operand = READ_LONG(); goto do_set_global;
+            CASE(OP_SET_GLOBAL): operand = READ_BYTE();
+            do_set_global:{
+                uint32_t slot = operand;
+                if (IS_UNDEFINED(globals.values[slot])){
+                    RUNTIME_ERROR("Undifined variable " + globals.names[slot]->strs + ".");
                 }
-                break;
+                globals.values[slot] = PEEK(0);
+                gc.writeBarrier(&globals, slot);
+                NEXT;
             }
-            case OP_GET_UPVALUE:{
-                uint8_t slot = read_byte();
-                stack_push(*frame->closure->upvalues[slot]->location);
-                break;
+            CASE(OP_GET_UPVALUE):{
+                uint8_t slot = READ_BYTE();
+                PUSH(*frame->closure->upvalues[slot]->location);
+                NEXT;
             }
-            case OP_SET_UPVALUE:{
-                uint8_t slot = read_byte();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+            CASE(OP_SET_UPVALUE):{
+                uint8_t slot = READ_BYTE();
+                ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+                *upvalue->location = PEEK(0);
+                gc.writeBarrier((Obj*)upvalue, PEEK(0));
+                NEXT;
             }
-            case OP_EQUAL:{
-                value_t b = stack_pop();
-                value_t a = stack_pop();
-                bool flag = Value::valuesEqual(a, b);
-                stack_push(BOOL_VAL(flag));
-                break;
+            CASE(OP_EQUAL):{
+                value_t b = POP();
+                value_t a = POP();
+                PUSH(BOOL_VAL(Value::valuesEqual(a, b)));
+                NEXT;
+            }
+            CASE(OP_NOT_EQUAL):{
+                value_t b = POP();
+                value_t a = POP();
+                PUSH(BOOL_VAL(!Value::valuesEqual(a, b)));
+                NEXT;
+            }
+            CASE(OP_GREATER): BINARY_OP(BOOL_VAL, >); NEXT;
+            CASE(OP_LESS):
+                if(IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) QUICKEN(OP_LESS_NUM);
+            do_less:
+                BINARY_OP(BOOL_VAL, <);
+                NEXT;
+            CASE(OP_LESS_NUM):{
+                if(!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))){
+                    QUICKEN(OP_LESS);
+                    goto do_less;
+                }
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(BOOL_VAL(a < b));
+                NEXT;
+            }
+            CASE(OP_GREATER_EQUAL):{
+                if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                    RUNTIME_ERROR("Operands must be numbers.");
+                }
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(BOOL_VAL(!(a < b)));
+                NEXT;
+            }
+            CASE(OP_LESS_EQUAL):{
+                if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                    RUNTIME_ERROR("Operands must be numbers.");
+                }
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(BOOL_VAL(!(a > b)));
+                NEXT;
+            }
+            // OP_ADD turns itself into OP_ADD_NUM or OP_ADD_STR for the
+            // operand types it sees, and those go back to OP_ADD when their
+            // guard fails
+            CASE(OP_ADD):{
+                if(IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))){
+                    QUICKEN(OP_ADD_NUM);
+                }else if(IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))){
+                    QUICKEN(OP_ADD_STR);
+                }
+                goto do_add;
+            }
+            CASE(OP_ADD_NUM):{
+                if(!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))){
+                    QUICKEN(OP_ADD);
+                    goto do_add;
+                }
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(NUMBER_VAL(a + b));
+                NEXT;
+            }
+            CASE(OP_ADD_STR):{
+                if(!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))){
+                    QUICKEN(OP_ADD);
+                    goto do_add;
+                }
+                STORE_FRAME();
+                concatenate();
+                sp = stack_ptr;
+                NEXT;
             }
-            case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-            case OP_ADD: {
-                if(IS_STRING(peek(0)) && IS_STRING(peek(1))){
+            do_add:{
+                if(IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))){
+                    double b = AS_NUMBER(POP());
+                    double a = AS_NUMBER(POP());
+                    PUSH(NUMBER_VAL(a + b));
+                }else if(IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))){
+                    STORE_FRAME();
                     concatenate();
-                }else if(IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))){
-                    BINARY_OP(NUMBER_VAL, +);
+                    sp = stack_ptr;
                 }else{
-                    runtimeError("Operands must be two number or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Operands must be two number or two strings.");
                 }
-                break;
+                NEXT;
             }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT: stack_push(BOOL_VAL(isFalsey(stack_pop()))); break;
-            case OP_NEGATE:{
-                if (!IS_NUMBER(peek(0))){
-                    runtimeError("Operand must be a number");
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_R_ADD):{
+                uint8_t dst = READ_BYTE();
+                value_t a = READ_REGISTER();
+                value_t b = READ_REGISTER();
+                if(IS_NUMBER(a) && IS_NUMBER(b)){
+                    WRITE_REGISTER(dst, NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                }else if(IS_STRING(a) && IS_STRING(b)){
+                    PUSH(a);
+                    PUSH(b);
+                    STORE_FRAME();
+                    concatenate();
+                    sp = stack_ptr;
+                    value_t result = POP();
+                    WRITE_REGISTER(dst, result);
+                }else{
+                    RUNTIME_ERROR("Operands must be two number or two strings.");
                 }
-                stack_push(NUMBER_VAL(- AS_NUMBER(stack_pop())));
-                break;
+                NEXT;
             }
-            case OP_PRINT:{
-                Value::printValue(stack_pop());
-                std::cout << std::endl;
-                break;
+            CASE(OP_R_SUBTRACT): REGISTER_OP(NUMBER_VAL, -); NEXT;
+            CASE(OP_R_MULTIPLY): REGISTER_OP(NUMBER_VAL, *); NEXT;
+            CASE(OP_R_DIVIDE): REGISTER_OP(NUMBER_VAL, /); NEXT;
+            CASE(OP_R_LESS): REGISTER_OP(BOOL_VAL, <); NEXT;
+            CASE(OP_R_GREATER): REGISTER_OP(BOOL_VAL, >); NEXT;
+            CASE(OP_R_MOVE):{
+                uint8_t dst = READ_BYTE();
+                frame->slots[dst-1] = READ_REGISTER();
+                NEXT;
             }
-            case OP_JUMP:{
-                uint16_t offset = read_short();
-                frame->ip += offset;
-                break;
+            CASE(OP_R_LESS_JUMP):{
+                value_t a = READ_REGISTER();
+                value_t b = READ_REGISTER();
+                if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                    RUNTIME_ERROR("Operands must be numbers.");
+                }
+                uint16_t offset = READ_SHORT();
+                if (!(AS_NUMBER(a) < AS_NUMBER(b))) ip += offset;
+                NEXT;
             }
-            case OP_JUMP_IF_FALSE:{
-                uint16_t offset = read_short();
-                if (isFalsey(peek(0))) frame->ip += offset;
-                break;
+            CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); NEXT;
+            CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); NEXT;
+            CASE(OP_DIVIDE): BINARY_OP(NUMBER_VAL, /); NEXT;
+            CASE(OP_NOT): PEEK(0) = BOOL_VAL(isFalsey(PEEK(0))); NEXT;
+            CASE(OP_NEGATE):{
+                if (!IS_NUMBER(PEEK(0))){
+                    RUNTIME_ERROR("Operand must be a number");
+                }
+                PEEK(0) = NUMBER_VAL(- AS_NUMBER(PEEK(0)));
+                NEXT;
+            }
+            CASE(OP_PRINT):{
+                output.writeValue(POP());
+                output.newline();
+                NEXT;
+            }
+            CASE(OP_JUMP):{
+                uint16_t offset = READ_SHORT();
+                ip += offset;
+                NEXT;
+            }
+            CASE(OP_LESS_JUMP_IF_FALSE):{
+                if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                    RUNTIME_ERROR("Operands must be numbers.");
+                }
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                uint16_t offset = READ_SHORT();
+                if (!(a < b)) ip += offset;
+                NEXT;
             }
-            case OP_LOOP: {
-                uint16_t offset = read_short();
-                frame->ip -= offset;
-                break; 
+            CASE(OP_JUMP_IF_FALSE):{
+                uint16_t offset = READ_SHORT();
+                if (isFalsey(PEEK(0))) ip += offset;
+                NEXT;
             }
-            case OP_CALL:{
-                int argCount = read_byte();
-                if(!callValue(peek(argCount), argCount)){
+            CASE(OP_LOOP):{
+                uint16_t offset = READ_SHORT();
+                ip -= offset;
+                stack_ptr = sp;
+                gc.safepoint();
+                if(jitted) goto run_jit;
+                if(jitConfig.traces && frame->closure->function->backEdges++ >= jitConfig.traceThreshold){
+                    goto run_trace;
+                }
+                NEXT;
+            }
+            CASE(OP_CALL):{
+                int argCount = READ_BYTE();
+                value_t callee = PEEK(argCount);
+                STORE_FRAME();
+                // a native returns to this frame, which needs no reloading
+                if(IS_OBJ(callee) && OBJ_TYPE(callee) == OBJ_NATIVE){
+                    if(!callNative(AS_NATIVE(callee), argCount)){
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    sp = stack_ptr;
+                    if(jitted) goto run_jit;
+                    NEXT;
+                }
+                if(!callValue(callee, argCount)){
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &frames[frameCount-1];
-                break;
+                ENTER_FRAME();
+                NEXT;
             }
-            case OP_INVOKE: {
-                ObjString* method = AS_STRING(frame->closure->function->chunk->getValue(read_byte()));
-                int argCount = read_byte();
-                if(!invoke(method, argCount)){
+            CASE(OP_INVOKE_LONG): operand = READ_LONG(); goto do_invoke;
+            CASE(OP_INVOKE): operand = READ_BYTE();
+            do_invoke:{
+                ObjString* method = OPERAND_STRING();
+                int argCount = READ_BYTE();
+                InlineCache* cache = frame->closure->function->chunk->getCache(READ_SHORT());
+                STORE_FRAME();
+                if(!invoke(method, argCount, cache)){
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &frames[frameCount-1];
-                break;
+                ENTER_FRAME();
+                NEXT;
             }
-            case OP_CLOSURE:{
-                // suppose to get function obj
-                value_t constant = frame->closure->function->chunk->getValue(read_byte());
-                ObjFunction* function = AS_FUNCTION(constant);
-                ObjClosure* closure = new ObjClosure(function);
+            CASE(OP_CLOSURE_LONG): operand = READ_LONG(); goto do_closure;
+            CASE(OP_CLOSURE): operand = READ_BYTE();
+            do_closure:{
+                ObjFunction* function = AS_FUNCTION(constants[operand]);
+                STORE_FRAME();
+                ObjClosure* closure = gc.allocateObject<ObjClosure>(function);
                 stack_push(OBJ_VAL(closure));
 
                 for(int i=0; i < closure->upvalueCount; i++){
-                    uint8_t isLocal = read_byte();
-                    uint8_t index = read_byte();
+                    uint8_t isLocal = READ_BYTE();
+                    uint8_t index = READ_BYTE();
                     if(isLocal){
                         closure->upvalues[i] = captureUpvalue(
-                            &(*(frame->slots+index)));
+                            &(*(frame->slots+index-1)));
                     }else{
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
+                    // capturing may have collected and promoted the closure
+                    gc.writeBarrier((Obj*)closure, OBJ_VAL(closure->upvalues[i]));
                 }
-                break;
+                sp = stack_ptr;
+                NEXT;
             }
-            case OP_CLOSE_UPVALUE:{
-                closeUpvalues(&(*(stack_ptr-1)));
-                stack_pop();
-                break;
+            CASE(OP_CLOSE_UPVALUE):{
+                closeUpvalues(&(*(sp-1)));
+                POP();
+                NEXT;
             }
-            case OP_RETURN:{
-                value_t result = stack_pop();
-                closeUpvalues(&(*(frame->slots)));
+            CASE(OP_RETURN):{
+                value_t result = POP();
+                // slot 0 (the callee or 'this') sits just below slots
+                closeUpvalues(&(*(frame->slots-1)));
                 frameCount--;
                 if(frameCount == 0){
-                    stack_pop();
+                    POP();
+                    stack_ptr = sp;
                     return INTERPRET_OK;
                 }
-                stack_ptr = frame->slots-1;
-                stack_push(result);
-                frame = &frames[frameCount-1];
-                break;
+                sp = frame->slots-1;
+                PUSH(result);
+                stack_ptr = sp;
+                ENTER_FRAME();
+                NEXT;
             }
-            case OP_CLASS:{
-                stack_push(OBJ_VAL(
-                    new ObjClass(AS_STRING(frame->closure->function->chunk->getValue(read_byte()))))
-                    );
-                break;
+            CASE(OP_CLASS_LONG): operand = READ_LONG(); goto do_class;
+            CASE(OP_CLASS): operand = READ_BYTE();
+            do_class:{
+                ObjString* name = OPERAND_STRING();
+                STORE_FRAME();
+                PUSH(OBJ_VAL(gc.allocateObject<ObjClass>(name)));
+                NEXT;
             }
-            case OP_GET_PROPERTY:{
-                if(!IS_INSTANCE(peek(0))){
-                    runtimeError("Only instance have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_GET_THIS_PROPERTY):{
+                // a field already cached for this shape is read without
+                // going through the stack
+                value_t receiver = frame->slots[-1];
+                if(IS_INSTANCE(receiver)){
+                    ObjInstance* instance = AS_INSTANCE(receiver);
+                    InlineCache* cache = frame->closure->function->chunk->getCache((ip[1] << 8) | ip[2]);
+                    CacheEntry* entry = cache->find(instance->shape, instance->klass);
+                    if(entry != NULL && entry->method == NULL){
+                        cacheStats.hits++;
+                        ip += 3;
+                        PUSH(instance->fields[entry->slot]);
+                        NEXT;
+                    }
+                }
+                PUSH(receiver);
+                operand = READ_BYTE();
+                goto do_get_property;
+            }
+            CASE(OP_GET_PROPERTY_LONG): operand = READ_LONG(); goto do_get_property;
+            CASE(OP_GET_PROPERTY): operand = READ_BYTE();
+            do_get_property:{
+                if(!IS_INSTANCE(PEEK(0))){
+                    RUNTIME_ERROR("Only instance have properties.");
+                }
+                ObjInstance* instance = AS_INSTANCE(PEEK(0));
+                ObjString* name = OPERAND_STRING();
+                InlineCache* cache = frame->closure->function->chunk->getCache(READ_SHORT());
+
+                CacheEntry* entry = cache->find(instance->shape, instance->klass);
+                if(entry != NULL){
+                    cacheStats.hits++;
+                    if(entry->method == NULL){
+                        POP();
+                        PUSH(instance->fields[entry->slot]);
+                    }else{
+                        STORE_FRAME();
+                        ObjBoundMethod* bound = gc.allocateObject<ObjBoundMethod>(PEEK(0), entry->method);
+                        POP();
+                        PUSH(OBJ_VAL(bound));
+                    }
+                    NEXT;
                 }
-                ObjInstance* instance = AS_INSTANCE(peek(0));
-                ObjString* name = AS_STRING(frame->closure->function->chunk->getValue(read_byte()));
+                entry = cacheMiss(cache);
 
-                value_t val;
-                if(!(instance->fields.find(name->strs) == instance->fields.end())){
-                    stack_pop();
-                    stack_push(instance->fields[name->strs]);
-                    break;
+                int slot = instance->shape->lookup(name);
+                if(slot >= 0){
+                    if(entry != NULL){
+                        entry->shape = instance->shape;
+                        entry->slot = slot;
+                    }
+                    POP();
+                    PUSH(instance->fields[slot]);
+                    NEXT;
                 }
 
+                auto method = instance->klass->methods.find(name);
+                if(method != instance->klass->methods.end()){
+                    cacheMethod(entry, instance->shape, instance->klass, AS_CLOSURE(method->second));
+                }
+                STORE_FRAME();
                 if(!bindMethod(instance->klass, name)){
                     return INTERPRET_RUNTIME_ERROR;
                 }
-
-                break;
+                sp = stack_ptr;
+                NEXT;
             }
-            case OP_SET_PROPERTY:{
-                if(!IS_INSTANCE(peek(1))){
-                    runtimeError("Only instance have feilds.");
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_SET_PROPERTY_LONG): operand = READ_LONG(); goto do_set_property;
+            CASE(OP_SET_PROPERTY): operand = READ_BYTE();
+            do_set_property:{
+                if(!IS_INSTANCE(PEEK(1))){
+                    RUNTIME_ERROR("Only instance have feilds.");
                 }
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                ObjString* field_name = AS_STRING(frame->closure->function->chunk->getValue(read_byte()));
-                instance->fields[field_name->strs] = peek(0);
-                value_t val = stack_pop();
-                stack_push(val);
-                break;
+                ObjInstance* instance = AS_INSTANCE(PEEK(1));
+                ObjString* field_name = OPERAND_STRING();
+                InlineCache* cache = frame->closure->function->chunk->getCache(READ_SHORT());
+                CacheEntry* entry = cache->find(instance->shape, NULL);
+                if(entry != NULL){
+                    cacheStats.hits++;
+                    if(entry->next != NULL){
+                        instance->shape = entry->next;
+                        instance->fields.push_back(PEEK(0));
+                    }else{
+                        instance->fields[entry->slot] = PEEK(0);
+                    }
+                }else{
+                    entry = cacheMiss(cache);
+                    Shape* shape = instance->shape;
+                    int slot = shape->lookup(field_name);
+                    Shape* next = NULL;
+                    if(slot >= 0){
+                        instance->fields[slot] = PEEK(0);
+                    }else{
+                        next = shapes.addProperty(shape, field_name);
+                        slot = next->slotCount - 1;
+                        instance->shape = next;
+                        instance->fields.push_back(PEEK(0));
+                    }
+                    if(entry != NULL){
+                        entry->shape = shape;
+                        entry->slot = slot;
+                        entry->next = next;
+                    }
+                }
+                gc.writeBarrier((Obj*)instance, PEEK(0));
+                value_t val = POP();
+                POP();
+                PUSH(val);
+                NEXT;
             }
-            case OP_METHOD:
-                defineMethod(AS_STRING(frame->closure->function->chunk->getValue(read_byte())));
-                break;
-            case OP_INHERIT:{
-                value_t superclass = peek(1);
-                if(!IS_CLASS(superclass)){
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_METHOD_LONG): operand = READ_LONG(); goto do_method;
+            CASE(OP_METHOD): operand = READ_BYTE();
+            do_method:{
+                ObjString* name = OPERAND_STRING();
+                // the compiler always leaves the class there, a damaged
+                // .levc file may not
+                if(!IS_CLASS(PEEK(1))){
+                    RUNTIME_ERROR("Methods must belong to a class.");
+                }
+                STORE_FRAME();
+                defineMethod(name);
+                sp = stack_ptr;
+                NEXT;
+            }
+            CASE(OP_INHERIT):{
+                value_t superclass = PEEK(1);
+                if(!IS_CLASS(superclass) || !IS_CLASS(PEEK(0))){
+                    RUNTIME_ERROR("Superclass must be a class.");
                 }
-                ObjClass* subclass = AS_CLASS(peek(0));
+                ObjClass* subclass = AS_CLASS(PEEK(0));
                 subclass->methods = AS_CLASS(superclass)->methods;
-                stack_pop();
-                break;
+                for(auto& method : subclass->methods){
+                    gc.writeBarrier((Obj*)subclass, OBJ_VAL(method.first));
+                    gc.writeBarrier((Obj*)subclass, method.second);
+                }
+                POP();
+                NEXT;
             }
-            case OP_GET_SUPER:{
-                ObjString* name = AS_STRING(frame->closure->function->chunk->getValue(read_byte()));
-                ObjClass* superclass = AS_CLASS(stack_pop());
-
+            CASE(OP_GET_SUPER_LONG): operand = READ_LONG(); goto do_get_super;
+            CASE(OP_GET_SUPER): operand = READ_BYTE();
+            do_get_super:{
+                ObjString* name = OPERAND_STRING();
+                if(!IS_CLASS(PEEK(0))){
+                    RUNTIME_ERROR("Superclass must be a class.");
+                }
+                ObjClass* superclass = AS_CLASS(POP());
+                STORE_FRAME();
                 if(!bindMethod(superclass, name)){
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                break;
+                sp = stack_ptr;
+                NEXT;
             }
-            case OP_SUPER_INVOKE:{
-                ObjString* method = AS_STRING(frame->closure->function->chunk->getValue(read_byte()));
-                int argCount = read_byte();
-                ObjClass* superclass = AS_CLASS(stack_pop());
-                if(!invokeFromClass(superclass, method, argCount)){
+            CASE(OP_SUPER_INVOKE_LONG): operand = READ_LONG(); goto do_super_invoke;
+            CASE(OP_SUPER_INVOKE): operand = READ_BYTE();
+            do_super_invoke:{
+                ObjString* method = OPERAND_STRING();
+                int argCount = READ_BYTE();
+                InlineCache* cache = frame->closure->function->chunk->getCache(READ_SHORT());
+                if(!IS_CLASS(PEEK(0))){
+                    RUNTIME_ERROR("Superclass must be a class.");
+                }
+                ObjClass* superclass = AS_CLASS(POP());
+                STORE_FRAME();
+                if(!invokeFromClass(superclass, method, argCount, cache)){
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &frames[frameCount-1];
-                break;
+                ENTER_FRAME();
+                NEXT;
+            }
+            // the compiled code returns at the first instruction it leaves
+            // to the interpreter
+            run_jit:{
+                STORE_FRAME();
+                ObjFunction* function = frame->closure->function;
+                value_t* top = function->aot != NULL ? function->aot(this, frame, &*sp)
+                                                     : Jit::execute(this, frame, &*sp);
+                sp = stack_memory->begin() + (top - stack_memory->data());
+                ip = frame->ip;
+                NEXT;
             }
+            // ip is the header of a loop, which its trace runs from
+            run_trace:{
+                STORE_FRAME();
+                value_t* top = Tracer::enter(this, frame, &*sp);
+                sp = stack_memory->begin() + (top - stack_memory->data());
+                ip = frame->ip;
+                NEXT;
+            }
+#ifndef COMPUTED_GOTO
         }
     }
+#endif
+
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef ENTER_FRAME
+#undef QUICKEN
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_LONG
+#undef OPERAND_STRING
+#undef READ_CONSTANT
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef RUNTIME_ERROR
+#undef BINARY_OP
+#undef READ_REGISTER
+#undef WRITE_REGISTER
+#undef REGISTER_OP
+#undef CASE
+#undef NEXT
 }
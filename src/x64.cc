@@ -0,0 +1,104 @@
+#include "x64.hpp"
+
+#ifdef JIT_X64
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Values are moved and written eight bytes at a time, a wider load of
+// something just stored in narrower pieces would stall on store forwarding.
+void X64Assembler::copyValue(Location dst, Location src){
+    for(int32_t i = 0; i < VALUE_SIZE; i += 8){
+        load(RAX, src.base, src.disp + i);
+        store(dst.base, dst.disp + i, RAX);
+    }
+}
+
+void X64Assembler::storeValue(Location dst, value_t val){
+#ifdef NAN_BOXING
+    moveImmediate(RAX, val);
+    store(dst.base, dst.disp, RAX);
+#else
+    uint64_t payload;
+    memcpy(&payload, &val.as, sizeof(payload));
+    storeImmediate(dst.base, dst.disp, val.type);
+    moveImmediate(RAX, payload);
+    store(dst.base, dst.disp + PAYLOAD, RAX);
+#endif
+}
+
+void X64Assembler::checkNumber(Location val, int fail){
+#ifdef NAN_BOXING
+    load(RAX, val.base, val.disp);
+    moveImmediate(RCX, QNAN);
+    alu(0x21, RAX, RCX);
+    alu(0x39, RAX, RCX);
+    jumpIf(CC_E, fail);
+#else
+    compareDword(val.base, val.disp, VAL_NUMBER);
+    jumpIf(CC_NE, fail);
+#endif
+}
+
+void X64Assembler::loadNumber(Location val, int xmm){
+    sse(0xf2, 0x10, xmm, val.base, val.disp + PAYLOAD);
+}
+
+void X64Assembler::storeNumber(Location dst, int xmm){
+#ifndef NAN_BOXING
+    storeImmediate(dst.base, dst.disp, VAL_NUMBER);
+#endif
+    sse(0xf2, 0x11, xmm, dst.base, dst.disp + PAYLOAD);
+}
+
+// from al
+void X64Assembler::storeBool(Location dst){
+    byte(0x0f); byte(0xb6); byte(0xc0);     // movzx eax, al
+#ifdef NAN_BOXING
+    moveImmediate(RCX, FALSE_VAL);
+    alu(0x09, RAX, RCX);
+#else
+    storeImmediate(dst.base, dst.disp, VAL_BOOL);
+#endif
+    store(dst.base, dst.disp + PAYLOAD, RAX);
+}
+
+void X64Assembler::branchIfFalsey(Location val, int label){
+#ifdef NAN_BOXING
+    load(RAX, val.base, val.disp);
+    moveImmediate(RCX, NIL_VAL);
+    alu(0x39, RAX, RCX);
+    jumpIf(CC_E, label);
+    moveImmediate(RCX, FALSE_VAL);
+    alu(0x39, RAX, RCX);
+    jumpIf(CC_E, label);
+#else
+    int truthy = newLabel();
+    compareDword(val.base, val.disp, VAL_NIL);
+    jumpIf(CC_E, label);
+    compareDword(val.base, val.disp, VAL_BOOL);
+    jumpIf(CC_NE, truthy);
+    compareByte(val.base, val.disp + PAYLOAD, 0);
+    jumpIf(CC_E, label);
+    bind(truthy);
+#endif
+}
+
+bool X64Assembler::install(JitCode* jit){
+    for(const Fixup& fixup : fixups){
+        int32_t distance = labels[fixup.label] - (fixup.at + 4);
+        memcpy(&out[fixup.at], &distance, sizeof(distance));
+    }
+
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    jit->size = (out.size() + pageSize - 1) / pageSize * pageSize;
+    void* memory = mmap(NULL, jit->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(memory == MAP_FAILED){
+        jit->size = 0;
+        return false;
+    }
+    jit->code = (uint8_t*)memory;
+    memcpy(jit->code, out.data(), out.size());
+    return mprotect(jit->code, jit->size, PROT_READ | PROT_EXEC) == 0;
+}
+
+#endif
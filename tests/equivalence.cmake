@@ -0,0 +1,27 @@
+# Runs SCRIPT with LEVI on the stack backend and on the register backend
+# and fails if the two print anything different. A script that reads
+# clock() prints the time it took last, that line is left out.
+#
+#   cmake -DLEVI=<levi> -DSCRIPT=<script.lev> -P equivalence.cmake
+
+function(run_levi result)
+    execute_process(COMMAND ${LEVI} --no-cache ${ARGN} ${SCRIPT}
+                    OUTPUT_VARIABLE output
+                    ERROR_VARIABLE output
+                    RESULT_VARIABLE status)
+    if(NOT status EQUAL 0)
+        message(FATAL_ERROR "levi ${ARGN} ${SCRIPT} exited with ${status}:\n${output}")
+    endif()
+    file(READ ${SCRIPT} source)
+    if(source MATCHES "clock\\(\\)")
+        string(REGEX REPLACE "[^\n]*\n$" "" output "${output}")
+    endif()
+    set(${result} "${output}" PARENT_SCOPE)
+endfunction()
+
+run_levi(stack)
+run_levi(registers --registers)
+if(NOT stack STREQUAL registers)
+    message(FATAL_ERROR "${SCRIPT} prints differently with --registers\n"
+                        "stack backend:\n${stack}\nregister backend:\n${registers}")
+endif()
@@ -0,0 +1,25 @@
+# Runs SCRIPT with LEVI and fails unless it prints exactly what the .out
+# file next to it holds. Options for levi can be given on the first line
+# of the script:
+#
+#   // levi: --gc-nursery=256
+#
+#   cmake -DLEVI=<levi> -DSCRIPT=<script.lev> -P expect.cmake
+
+file(STRINGS ${SCRIPT} first LIMIT_COUNT 1)
+set(options "")
+if(first MATCHES "^// levi: (.*)$")
+    separate_arguments(options UNIX_COMMAND "${CMAKE_MATCH_1}")
+endif()
+execute_process(COMMAND ${LEVI} --no-cache ${options} ${SCRIPT}
+                OUTPUT_VARIABLE output
+                ERROR_VARIABLE output
+                RESULT_VARIABLE status)
+if(NOT status EQUAL 0)
+    message(FATAL_ERROR "levi ${options} ${SCRIPT} exited with ${status}:\n${output}")
+endif()
+string(REGEX REPLACE "\\.lev$" ".out" expectedPath ${SCRIPT})
+file(READ ${expectedPath} expected)
+if(NOT output STREQUAL expected)
+    message(FATAL_ERROR "${SCRIPT} printed\n${output}\ninstead of\n${expected}")
+endif()